@@ -0,0 +1,254 @@
+/* ---------------------------------------------------------------------------
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ * -------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "rtspconnectionclient.h"
+#include "codechandler.h"
+#include "h264handler.h"
+#include "h265handler.h"
+#include "substream.h"
+
+/* ---------------------------------------------------------------------------
+**  previous implementation of the handlers, kept as reference
+** -------------------------------------------------------------------------*/
+std::tuple<Json::Value,std::string> legacyAudio(const SessionParams& params, unsigned char* buffer, ssize_t size, struct timeval presentationTime) {
+	Json::Value data;
+	data["media"] = params.m_media;
+	data["codec"] = params.m_codec;
+	data["freq"] = params.m_rtpfrequency;
+	data["channels"] = params.m_channels;
+	data["ts"] = Json::Value::UInt64(1000ULL*1000*presentationTime.tv_sec+presentationTime.tv_usec);
+	std::string buf(buffer, buffer+size);        
+	return std::make_tuple(data, buf);
+}
+
+std::tuple<Json::Value,std::string> legacyH264(std::string& sps, std::string& pps, unsigned char* buffer, ssize_t size, struct timeval presentationTime) {
+	std::string buf(buffer, buffer + size);
+	int nalu = buffer[4] & 0x1F;
+	if (nalu == H264_SPS) {
+		sps = buf;
+	} else if (nalu == H264_PPS) {
+		pps = buf;
+	} else if (nalu == H264_IDR) {
+		buf.insert(0, pps);
+		buf.insert(0, sps);
+	}
+	if (nalu == H264_IDR || nalu == H264_SLICE) {
+		Json::Value data;
+		data["ts"] = Json::Value::UInt64(1000ULL * 1000 * presentationTime.tv_sec + presentationTime.tv_usec);
+		std::stringstream ss;
+		for (int i = 5; (i < 8) && (i < sps.size()); i++) {
+			ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(sps[i]);
+		}
+		data["media"] = "video";
+		data["codec"] = "avc1." + ss.str();
+		if (nalu == H264_IDR) {
+			data["type"] = "keyframe";
+		}
+		return std::make_tuple(data, buf);
+	} else {
+		return std::make_tuple(Json::Value(), "");
+	}
+}
+
+/* ---------------------------------------------------------------------------
+**  synthetic access units
+** -------------------------------------------------------------------------*/
+std::string nal(const std::vector<unsigned char>& header, size_t size) {
+	std::string buf(H26X_marker, H26X_marker + sizeof(H26X_marker));
+	buf.insert(buf.end(), header.begin(), header.end());
+	for (size_t i = buf.size(); i < size; ++i) {
+		buf.push_back(static_cast<char>(i * 131 + 7));
+	}
+	return buf;
+}
+
+unsigned char* ptr(std::string& buf) {
+	return reinterpret_cast<unsigned char*>(&buf[0]);
+}
+
+// pictures published and kept by a maxfps substream over one second of a GOP with one reference picture out of 3
+std::pair<size_t,size_t> thinned(CodecHandler& handler, const std::string& idr, const std::string& ref, const std::string& disposable, unsigned int fps, unsigned int maxfps) {
+	SubstreamFilters filters;
+	int index = filters.acquire(parseSubstream("full", maxfps));
+	size_t published = 0;
+	size_t kept = 0;
+	for (unsigned int i = 0; i <= fps; ++i) {
+		std::string buf = (i == 0) ? idr : (i % 3) ? disposable : ref;
+		struct timeval pts = { 1800000000, long(i * 1000000 / fps) };
+		auto frame = handler.onData(ptr(buf), buf.size(), pts);
+		// the picture pending from the previous measures is ignored, the last one only completes the second
+		if (frame && frame->timestamp() >= 1800000000ULL * 1000000 && frame->timestamp() < 1800000001ULL * 1000000) {
+			published++;
+			if (SubstreamFilters::selected(filters.select(*frame), index)) {
+				kept++;
+			}
+		}
+	}
+	return std::make_pair(published, kept);
+}
+
+double measure(const char* name, size_t iterations, const std::function<void(size_t)>& func) {
+	for (size_t i = 0; i < iterations / 10; ++i) {
+		func(i);
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i) {
+		func(i);
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+	printf("%-32s %10.1f ns/frame\n", name, ns);
+	return ns;
+}
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[]) 
+{
+	size_t iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+	size_t sliceSize = (argc > 2) ? atoi(argv[2]) : 4096;
+	struct timeval tv = { 1700000000, 0 };
+	size_t sink = 0;
+
+	std::string h264sps = nal({0x67, 0x64, 0xc0, 0x28, 0xac, 0xd9}, 24);
+	std::string h264pps = nal({0x68, 0xeb, 0xe3, 0xcb}, 8);
+	std::string h264slice = nal({0x41, 0x9a}, sliceSize);
+	std::string h265vps = nal({0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d}, 32);
+	std::string h265sps = nal({0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d}, 48);
+	std::string h265pps = nal({0x44, 0x01, 0xc1, 0x72}, 12);
+	std::string h265slice = nal({0x02, 0x01, 0xd0}, sliceSize);
+	std::string aac(256, 'a');
+
+	FramePool pool;
+	SessionParams audioParams("audio", "mp4a.40.2", 48000, 2);
+
+	printf("slice size: %zu bytes, %zu iterations\n", sliceSize, iterations);
+
+	measure("audio legacy", iterations, [&](size_t i) {
+		auto data = legacyAudio(audioParams, ptr(aac), aac.size(), tv);
+		sink += std::get<1>(data).size();
+	});
+	CodecHandler audio(audioParams, pool);
+	measure("audio", iterations, [&](size_t i) {
+		sink += audio.onData(ptr(aac), aac.size(), tv)->metaSize();
+	});
+
+	std::string sps, pps;
+	legacyH264(sps, pps, ptr(h264sps), h264sps.size(), tv);
+	legacyH264(sps, pps, ptr(h264pps), h264pps.size(), tv);
+	measure("h264 slice legacy", iterations, [&](size_t i) {
+		auto data = legacyH264(sps, pps, ptr(h264slice), h264slice.size(), tv);
+		sink += std::get<1>(data).size();
+	});
+	H264Handler h264(SessionParams("video", "H264"), pool);
+	h264.onData(ptr(h264sps), h264sps.size(), tv);
+	h264.onData(ptr(h264pps), h264pps.size(), tv);
+	measure("h264 slice", iterations, [&](size_t i) {
+		struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+		auto frame = h264.onData(ptr(h264slice), h264slice.size(), pts);
+		sink += frame ? frame->metaSize() : 0;
+	});
+
+	H265Handler h265(SessionParams("video", "H265"), pool);
+	h265.onData(ptr(h265vps), h265vps.size(), tv);
+	h265.onData(ptr(h265sps), h265sps.size(), tv);
+	h265.onData(ptr(h265pps), h265pps.size(), tv);
+	measure("h265 slice", iterations, [&](size_t i) {
+		struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+		auto frame = h265.onData(ptr(h265slice), h265slice.size(), pts);
+		sink += frame ? frame->metaSize() : 0;
+	});
+	printf("h264 codec: %s\nh265 codec: %s\n", h264.codec().c_str(), h265.codec().c_str());
+
+	// multi-slice pictures : one message per picture
+	const size_t nbSlices = 4;
+	std::string h264first = nal({0x41, 0x9a}, sliceSize / nbSlices);
+	std::string h264next = nal({0x41, 0x1a}, sliceSize / nbSlices);
+	size_t messages = 0;
+	measure("h264 4 slices/picture legacy", iterations, [&](size_t i) {
+		struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+		for (size_t slice = 0; slice < nbSlices; ++slice) {
+			std::string & buf = slice ? h264next : h264first;
+			auto data = legacyH264(sps, pps, ptr(buf), buf.size(), pts);
+			sink += std::get<1>(data).size();
+		}
+	});
+	printf("%-32s %10.1f messages/picture\n", "", double(nbSlices));
+	measure("h264 4 slices/picture", iterations, [&](size_t i) {
+		struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+		for (size_t slice = 0; slice < nbSlices; ++slice) {
+			std::string & buf = slice ? h264next : h264first;
+			if (h264.onData(ptr(buf), buf.size(), pts)) {
+				messages++;
+			}
+		}
+	});
+	printf("%-32s %10.1f messages/picture\n", "", double(messages) / (iterations + iterations / 10));
+
+	// keyframes : parameter sets in front of the IDR
+	struct { const char* name; size_t size; } idrSizes[] = { {"1080p", 200*1024}, {"4K", 500*1024} };
+	for (auto & idrSize : idrSizes) {
+		std::string h264idr = nal({0x65, 0x88}, idrSize.size);
+		std::string h265idr = nal({0x26, 0x01, 0xaf}, idrSize.size);
+		size_t idrIterations = std::max(size_t(100), iterations * sliceSize / idrSize.size);
+		std::string label = std::string("h264 idr ") + idrSize.name;
+		printf("idr size: %zu bytes\n", idrSize.size);
+
+		double ns = measure((label + " legacy").c_str(), idrIterations, [&](size_t i) {
+			auto data = legacyH264(sps, pps, ptr(h264idr), h264idr.size(), tv);
+			sink += std::get<1>(data).size();
+		});
+		printf("%-32s %10.1f MB/s\n", "", idrSize.size * 1000.0 / ns);
+		ns = measure(label.c_str(), idrIterations, [&](size_t i) {
+			struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+			auto frame = h264.onData(ptr(h264idr), h264idr.size(), pts);
+			sink += frame ? frame->size() : 0;
+		});
+		printf("%-32s %10.1f MB/s\n", "", idrSize.size * 1000.0 / ns);
+		label = std::string("h265 idr ") + idrSize.name;
+		ns = measure(label.c_str(), idrIterations, [&](size_t i) {
+			struct timeval pts = { tv.tv_sec, long(i % 1000000) };
+			auto frame = h265.onData(ptr(h265idr), h265idr.size(), pts);
+			sink += frame ? frame->size() : 0;
+		});
+		printf("%-32s %10.1f MB/s\n", "", idrSize.size * 1000.0 / ns);
+	}
+
+	// substreams : maxfps drops the disposable pictures
+	std::string h264idr = nal({0x65, 0x88}, sliceSize);
+	std::string h264disposable = nal({0x01, 0x9a}, sliceSize);
+	std::string h265idr = nal({0x26, 0x01, 0xaf}, sliceSize);
+	std::string h265disposable = nal({0x00, 0x01, 0xd0}, sliceSize);
+	bool thinning = true;
+	struct { const char* name; CodecHandler& handler; std::string& idr; std::string& ref; std::string& disposable; } substreams[] = {
+		{ "h264 maxfps=10 of 30fps", h264, h264idr, h264slice, h264disposable },
+		{ "h265 maxfps=10 of 30fps", h265, h265idr, h265slice, h265disposable },
+	};
+	for (auto & substream : substreams) {
+		auto count = thinned(substream.handler, substream.idr, substream.ref, substream.disposable, 30, 10);
+		printf("%-32s %10zu of %zu pictures\n", substream.name, count.second, count.first);
+		// every picture is published, the reference ones are kept
+		thinning &= (count.first == 30) && (count.second == 10);
+	}
+
+	return (sink == 0) || !thinning;
+}
@@ -0,0 +1,510 @@
+/* ---------------------------------------------------------------------------
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ * -------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cxxopts.hpp"
+#include "liveMedia.hh"
+
+#include "httpserver.h"
+
+/* ---------------------------------------------------------------------------
+**  elementary stream split in NAL units, without start codes
+** -------------------------------------------------------------------------*/
+struct ElementaryStream {
+	bool                      m_h265 = false;
+	std::vector<std::string>  m_nals;
+	std::string               m_vps;
+	std::string               m_sps;
+	std::string               m_pps;
+
+	int type(const std::string & nal) const {
+		return m_h265 ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+	}
+
+	bool isVCL(const std::string & nal) const {
+		int nalu = this->type(nal);
+		return m_h265 ? (nalu < 32) : (nalu >= 1 && nalu <= 5);
+	}
+
+	bool isFirstSlice(const std::string & nal) const {
+		size_t offset = m_h265 ? 2 : 1;
+		return (nal.size() > offset) && (nal[offset] & 0x80);
+	}
+
+	// a picture ends with a VCL unit followed by a parameter set, an SEI or the first slice of the next picture
+	bool endsAccessUnit(size_t idx) const {
+		const std::string & next = m_nals[(idx + 1) % m_nals.size()];
+		return this->isVCL(m_nals[idx]) && (!this->isVCL(next) || this->isFirstSlice(next));
+	}
+
+	void add(const std::string & nal) {
+		if (nal.empty()) {
+			return;
+		}
+		int nalu = this->type(nal);
+		if (m_h265) {
+			if (nalu == 32 && m_vps.empty()) m_vps = nal;
+			if (nalu == 33 && m_sps.empty()) m_sps = nal;
+			if (nalu == 34 && m_pps.empty()) m_pps = nal;
+		} else {
+			if (nalu == 7 && m_sps.empty()) m_sps = nal;
+			if (nalu == 8 && m_pps.empty()) m_pps = nal;
+		}
+		m_nals.push_back(nal);
+	}
+
+	bool load(const std::string & path, bool h265) {
+		m_h265 = h265;
+		std::ifstream ifs(path.c_str(), std::ios::binary);
+		std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+		size_t start = std::string::npos;
+		size_t pos = 0;
+		while ((pos = data.find(std::string("\0\0\1", 3), pos)) != std::string::npos) {
+			if (start != std::string::npos) {
+				size_t end = (pos > 0 && data[pos - 1] == 0) ? pos - 1 : pos;
+				this->add(data.substr(start, end - start));
+			}
+			pos += 3;
+			start = pos;
+		}
+		if (start != std::string::npos) {
+			this->add(data.substr(start));
+		}
+		return this->valid();
+	}
+
+	// 1080p H.264 GOP with constant picture sizes, the payload is never decoded
+	void synthetic(unsigned int gop, size_t keyFrameSize, size_t frameSize) {
+		m_h265 = false;
+		this->add(std::string("\x67\x64\x00\x28\xac\xd9\x40\x78\x02\x27\xe5\x84\x00\x00\x03\x00\x04\x00\x00\x03\x00\xc8\x3c\x60\xc6\x58", 26));
+		this->add(std::string("\x68\xeb\xe3\xcb\x22\xc0", 6));
+		for (unsigned int i = 0; i < gop; ++i) {
+			std::string nal = i ? std::string("\x41\x9a", 2) : std::string("\x65\x88", 2);
+			size_t size = i ? frameSize : keyFrameSize;
+			for (size_t j = nal.size(); j < size; ++j) {
+				nal.push_back(static_cast<char>((j * 131) | 1));
+			}
+			this->add(nal);
+		}
+	}
+
+	bool valid() const {
+		return !m_sps.empty() && !m_pps.empty() && (!m_h265 || !m_vps.empty())
+			&& std::any_of(m_nals.begin(), m_nals.end(), [this](const std::string & nal) { return this->isVCL(nal); });
+	}
+};
+
+/* ---------------------------------------------------------------------------
+**  live555 source looping over the NAL units, one picture every 1/fps
+** -------------------------------------------------------------------------*/
+class PacedNalSource : public FramedSource {
+public:
+	static PacedNalSource* createNew(UsageEnvironment& env, const ElementaryStream & es, double fps) {
+		return new PacedNalSource(env, es, fps);
+	}
+
+protected:
+	PacedNalSource(UsageEnvironment& env, const ElementaryStream & es, double fps)
+		: FramedSource(env), m_es(es), m_period(1000000 / fps), m_index(0), m_newAccessUnit(true), m_task(NULL) {
+		m_next = now();
+	}
+
+	virtual ~PacedNalSource() {
+		envir().taskScheduler().unscheduleDelayedTask(m_task);
+	}
+
+	void doGetNextFrame() override {
+		int64_t delay = 0;
+		if (m_newAccessUnit) {
+			m_next += m_period;
+			delay = m_next - now();
+			if (delay < -m_period) {
+				// late by more than one picture, do not burst to catch up
+				m_next = now();
+				delay = 0;
+			}
+		}
+		m_task = envir().taskScheduler().scheduleDelayedTask(std::max<int64_t>(delay, 0), PacedNalSource::deliver, this);
+	}
+
+	void doStopGettingFrames() override {
+		envir().taskScheduler().unscheduleDelayedTask(m_task);
+	}
+
+private:
+	static int64_t now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return 1000000LL * tv.tv_sec + tv.tv_usec;
+	}
+
+	static void deliver(void* clientData) {
+		static_cast<PacedNalSource*>(clientData)->deliver();
+	}
+
+	void deliver() {
+		m_task = NULL;
+		if (m_newAccessUnit) {
+			gettimeofday(&m_pts, NULL);
+			m_newAccessUnit = false;
+		}
+		const std::string & nal = m_es.m_nals[m_index];
+		fFrameSize = std::min<unsigned>(nal.size(), fMaxSize);
+		fNumTruncatedBytes = nal.size() - fFrameSize;
+		memcpy(fTo, nal.data(), fFrameSize);
+		fPresentationTime = m_pts;
+		fDurationInMicroseconds = 0;
+		m_newAccessUnit = m_es.endsAccessUnit(m_index);
+		m_index = (m_index + 1) % m_es.m_nals.size();
+		FramedSource::afterGetting(this);
+	}
+
+private:
+	const ElementaryStream &  m_es;
+	const int64_t             m_period;
+	size_t                    m_index;
+	bool                      m_newAccessUnit;
+	int64_t                   m_next;
+	struct timeval            m_pts;
+	TaskToken                 m_task;
+};
+
+class PacedVideoSubsession : public OnDemandServerMediaSubsession {
+public:
+	static PacedVideoSubsession* createNew(UsageEnvironment& env, const ElementaryStream & es, double fps) {
+		return new PacedVideoSubsession(env, es, fps);
+	}
+
+protected:
+	PacedVideoSubsession(UsageEnvironment& env, const ElementaryStream & es, double fps)
+		: OnDemandServerMediaSubsession(env, True), m_es(es), m_fps(fps) {}
+
+	FramedSource* createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate) override {
+		estBitrate = 5000;
+		FramedSource* source = PacedNalSource::createNew(envir(), m_es, m_fps);
+		if (m_es.m_h265) {
+			return H265VideoStreamDiscreteFramer::createNew(envir(), source);
+		}
+		return H264VideoStreamDiscreteFramer::createNew(envir(), source);
+	}
+
+	RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic, FramedSource* inputSource) override {
+		if (m_es.m_h265) {
+			return H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+				bytes(m_es.m_vps), m_es.m_vps.size(), bytes(m_es.m_sps), m_es.m_sps.size(), bytes(m_es.m_pps), m_es.m_pps.size());
+		}
+		return H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+			bytes(m_es.m_sps), m_es.m_sps.size(), bytes(m_es.m_pps), m_es.m_pps.size());
+	}
+
+private:
+	static const uint8_t* bytes(const std::string & nal) {
+		return reinterpret_cast<const uint8_t*>(nal.data());
+	}
+
+private:
+	const ElementaryStream &  m_es;
+	const double              m_fps;
+};
+
+/* ---------------------------------------------------------------------------
+**  websocket viewer
+** -------------------------------------------------------------------------*/
+std::atomic<bool> measuring(false);
+
+int64_t now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return 1000000LL * tv.tv_sec + tv.tv_usec;
+}
+
+struct Viewer {
+	bool                    m_binary = false;
+	struct mg_connection *  m_conn = NULL;
+	uint64_t                m_ts = 0;
+	std::atomic<bool>       m_closed{false};
+	unsigned long long      m_frames = 0;
+	unsigned long long      m_bytes = 0;
+	std::vector<int64_t>    m_latencies;
+
+	void onFrame(uint64_t ts, size_t size) {
+		if (measuring) {
+			m_frames++;
+			m_bytes += size;
+			m_latencies.push_back(now() - static_cast<int64_t>(ts));
+		}
+	}
+
+	static int onData(struct mg_connection *conn, int flags, char *data, size_t size, void *userdata) {
+		Viewer* viewer = static_cast<Viewer*>(userdata);
+		int opcode = flags & 0xf;
+		if (opcode == MG_WEBSOCKET_OPCODE_TEXT && !viewer->m_binary) {
+			std::string meta(data, size);
+			size_t pos = meta.find("\"ts\":");
+			if (pos != std::string::npos) {
+				viewer->m_ts = strtoull(meta.c_str() + pos + 5, NULL, 10);
+			}
+		} else if (opcode == MG_WEBSOCKET_OPCODE_BINARY) {
+			if (viewer->m_binary && size >= WS_FRAMING_HEADER_SIZE) {
+				uint64_t ts = 0;
+				for (int i = 0; i < 8; ++i) {
+					ts |= uint64_t(static_cast<unsigned char>(data[8 + i])) << (8 * i);
+				}
+				viewer->onFrame(ts, size - WS_FRAMING_HEADER_SIZE);
+			} else if (!viewer->m_binary) {
+				viewer->onFrame(viewer->m_ts, size);
+			}
+		}
+		return 1;
+	}
+
+	static void onClose(const struct mg_connection *conn, void *userdata) {
+		static_cast<Viewer*>(userdata)->m_closed = true;
+	}
+};
+
+/* ---------------------------------------------------------------------------
+**  process statistics
+** -------------------------------------------------------------------------*/
+double processCpu() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// CPU time of the threads whose name starts with prefix
+double threadsCpu(const std::string & prefix) {
+	double cpu = 0;
+	DIR* dir = opendir("/proc/self/task");
+	if (dir) {
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL) {
+			std::string task = std::string("/proc/self/task/") + entry->d_name;
+			std::string comm;
+			std::ifstream(task + "/comm") >> comm;
+			if (comm.compare(0, prefix.size(), prefix) != 0) {
+				continue;
+			}
+			std::ifstream ifs(task + "/stat");
+			std::string stat((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+			size_t pos = stat.rfind(')');
+			if (pos == std::string::npos) {
+				continue;
+			}
+			std::istringstream fields(stat.substr(pos + 2));
+			std::string field;
+			unsigned long long utime = 0, stime = 0;
+			for (int i = 3; i <= 15 && (fields >> field); ++i) {
+				if (i == 14) utime = std::stoull(field);
+				if (i == 15) stime = std::stoull(field);
+			}
+			cpu += double(utime + stime) / sysconf(_SC_CLK_TCK);
+		}
+		closedir(dir);
+	}
+	return cpu;
+}
+
+double residentMemory() {
+	long pages = 0, resident = 0;
+	std::ifstream("/proc/self/statm") >> pages >> resident;
+	return double(resident) * sysconf(_SC_PAGESIZE);
+}
+
+int64_t percentile(const std::vector<int64_t> & sorted, double q) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+}
+
+/* ---------------------------------------------------------------------------
+**  main
+** -------------------------------------------------------------------------*/
+int main(int argc, char* argv[])
+{
+	cxxopts::Options options(argv[0]);
+	options.add_options()
+		("h,help"        , "Print usage")
+		("h264"          , "H.264 elementary stream to replay (default: synthetic 1080p GOP)", cxxopts::value<std::string>()->default_value(""))
+		("h265"          , "H.265 elementary stream to replay"            , cxxopts::value<std::string>()->default_value(""))
+		("aac"           , "ADTS AAC stream added to each camera"         , cxxopts::value<std::string>()->default_value(""))
+		("f,fps"         , "Pictures per second of each camera"           , cxxopts::value<double>()->default_value("25"))
+		("s,streams"     , "Number of cameras"                            , cxxopts::value<unsigned int>()->default_value("1"))
+		("c,clients"     , "Websocket viewers per camera"                 , cxxopts::value<unsigned int>()->default_value("10"))
+		("d,duration"    , "Measure duration in seconds"                  , cxxopts::value<unsigned int>()->default_value("10"))
+		("w,warmup"      , "Warmup duration in seconds"                   , cxxopts::value<unsigned int>()->default_value("2"))
+		("b,binary"      , "Use the binary framing")
+		("P,port"        , "HTTP port"                                    , cxxopts::value<int>()->default_value("18080"))
+		("R,rtspport"    , "RTSP port"                                    , cxxopts::value<int>()->default_value("18554"))
+		("r,rtptransport", "RTP transport(udp,tcp)"                       , cxxopts::value<std::string>()->default_value("tcp"))
+		("m,recvmmsg"    , "Read the UDP RTP with recvmmsg instead of live555 (with -r udp)")
+		("L,loops"       , "RTSP event loop threads (0:number of cores)"  , cxxopts::value<unsigned int>()->default_value("0"))
+		;
+
+	auto result = options.parse(argc, argv);
+	if (result.count("help")) {
+		std::cout << options.help() << std::endl;
+		return 0;
+	}
+	double fps = result["fps"].as<double>();
+	unsigned int nbStreams = result["streams"].as<unsigned int>();
+	unsigned int nbClients = result["clients"].as<unsigned int>();
+	unsigned int duration = result["duration"].as<unsigned int>();
+	unsigned int warmup = result["warmup"].as<unsigned int>();
+	bool binary = result.count("binary") > 0;
+	int port = result["port"].as<int>();
+	int rtspPort = result["rtspport"].as<int>();
+	std::string aac = result["aac"].as<std::string>();
+	std::string rtptransport = result["rtptransport"].as<std::string>();
+	bool recvmmsg = result.count("recvmmsg") > 0;
+
+	ElementaryStream es;
+	if (!result["h265"].as<std::string>().empty()) {
+		es.load(result["h265"].as<std::string>(), true);
+	} else if (!result["h264"].as<std::string>().empty()) {
+		es.load(result["h264"].as<std::string>(), false);
+	} else {
+		es.synthetic(static_cast<unsigned int>(2 * fps), 100*1024, 8*1024);
+	}
+	if (!es.valid()) {
+		std::cout << "No parameter sets or slices in the elementary stream" << std::endl;
+		return 1;
+	}
+
+	// synthetic cameras
+	Environment env;
+	RTSPServer* rtspServer = RTSPServer::createNew(env, Port(rtspPort));
+	if (rtspServer == NULL) {
+		std::cout << "Cannot listen on RTSP port:" << rtspPort << std::endl;
+		return 1;
+	}
+	Json::Value config;
+	for (unsigned int i = 0; i < nbStreams; ++i) {
+		std::string name = "cam" + std::to_string(i);
+		ServerMediaSession* sms = ServerMediaSession::createNew(env, name.c_str());
+		sms->addSubsession(PacedVideoSubsession::createNew(env, es, fps));
+		if (!aac.empty()) {
+			sms->addSubsession(ADTSAudioFileServerMediaSubsession::createNew(env, aac.c_str(), True));
+		}
+		rtspServer->addServerMediaSession(sms);
+		char* url = rtspServer->rtspURL(sms);
+		config["urls"][name]["video"] = url;
+		if (recvmmsg) {
+			config["urls"][name]["ingest"] = "recvmmsg";
+		}
+		delete[] url;
+	}
+	std::thread rtspThread([&env]() {
+		pthread_setname_np(pthread_self(), "rtsp-source");
+		env.mainloop();
+	});
+
+	// server under test
+	std::vector<std::string> opts;
+	opts.push_back("document_root");
+	opts.push_back(".");
+	opts.push_back("listening_ports");
+	opts.push_back(std::to_string(port));
+	opts.push_back("num_threads");
+	opts.push_back(std::to_string(nbStreams * nbClients + 10));
+	int rc = 0;
+	{
+		HttpServer server(config, opts, rtptransport, result["loops"].as<unsigned int>(), 0);
+		if (server.getContext() == NULL) {
+			std::cout << "Cannot listen on port:" << port << std::endl;
+			rc = 1;
+		} else {
+			double memoryBefore = residentMemory();
+			std::vector<std::unique_ptr<Viewer>> viewers;
+			for (unsigned int i = 0; i < nbStreams; ++i) {
+				std::string path = "/cam" + std::to_string(i) + (binary ? "?framing=binary" : "");
+				for (unsigned int j = 0; j < nbClients; ++j) {
+					std::unique_ptr<Viewer> viewer(new Viewer());
+					viewer->m_binary = binary;
+					char error[256] = "";
+					viewer->m_conn = mg_connect_websocket_client("127.0.0.1", port, 0, error, sizeof(error), path.c_str(), NULL, Viewer::onData, Viewer::onClose, viewer.get());
+					if (viewer->m_conn == NULL) {
+						std::cout << "Cannot connect " << path << ": " << error << std::endl;
+						continue;
+					}
+					viewers.push_back(std::move(viewer));
+				}
+			}
+
+			std::this_thread::sleep_for(std::chrono::seconds(warmup));
+			double cpuStart = processCpu();
+			double ingestStart = threadsCpu("live555-");
+			double sourceStart = threadsCpu("rtsp-source");
+			auto start = std::chrono::steady_clock::now();
+			measuring = true;
+			std::this_thread::sleep_for(std::chrono::seconds(duration));
+			measuring = false;
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			double cpu = processCpu() - cpuStart;
+			double ingest = threadsCpu("live555-") - ingestStart;
+			double source = threadsCpu("rtsp-source") - sourceStart;
+			double memory = residentMemory() - memoryBefore;
+
+			for (auto & viewer : viewers) {
+				mg_close_connection(viewer->m_conn);
+			}
+
+			unsigned long long frames = 0, bytes = 0;
+			std::vector<int64_t> latencies;
+			for (auto & viewer : viewers) {
+				frames += viewer->m_frames;
+				bytes += viewer->m_bytes;
+				latencies.insert(latencies.end(), viewer->m_latencies.begin(), viewer->m_latencies.end());
+			}
+			std::sort(latencies.begin(), latencies.end());
+			size_t nbViewers = std::max<size_t>(1, viewers.size());
+
+			printf("%u streams x %u viewers, %.1f fps, %s framing, %s ingest over %s, %.1f s\n", nbStreams, nbClients, fps, binary ? "binary" : "json", recvmmsg ? "recvmmsg" : "live555", rtptransport.c_str(), elapsed);
+			printf("%-32s %10zu\n", "viewers connected", viewers.size());
+			printf("%-32s %10.1f frames/s\n", "received per viewer", frames / elapsed / nbViewers);
+			printf("%-32s %10.1f Mbit/s\n", "received total", bytes * 8 / elapsed / 1e6);
+			printf("%-32s %10.1f ms\n", "latency p50", percentile(latencies, 0.5) / 1000.0);
+			printf("%-32s %10.1f ms\n", "latency p90", percentile(latencies, 0.9) / 1000.0);
+			printf("%-32s %10.1f ms\n", "latency p99", percentile(latencies, 0.99) / 1000.0);
+			printf("%-32s %10.1f ms\n", "latency max", latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+			printf("%-32s %10.1f %%\n", "ingest cpu per stream", 100.0 * ingest / elapsed / nbStreams);
+			printf("%-32s %10.1f %%\n", "process cpu (with viewers)", 100.0 * (cpu - source) / elapsed);
+			printf("%-32s %10.1f %%\n", "rtsp source cpu", 100.0 * source / elapsed);
+			printf("%-32s %10.1f KB\n", "memory per viewer", memory / nbViewers / 1024);
+			rc = (frames == 0);
+		}
+	}
+
+	env.stop();
+	rtspThread.join();
+	Medium::close(rtspServer);
+	return rc;
+}
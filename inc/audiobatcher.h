@@ -0,0 +1,88 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "framebuffer.h"
+#include "framing.h"
+
+/*
+ * Audio frames of a track waiting to be sent together in one websocket message, see framing.h for the layout.
+ * The stream sends a batch when it spans the aggregation window, when its window expired,
+ * and before a video frame for the audio frames older than it so the tracks stay in presentation order.
+ */
+class AudioBatcher {
+public:
+    explicit AudioBatcher(FramePool & pool) : m_pool(pool) {}
+
+    void add(const FramePtr & frame) {
+        m_frames.push_back(frame);
+    }
+
+    bool empty() const { return m_frames.empty(); }
+
+    // time covered by the pending frames
+    uint64_t span() const {
+        return m_frames.empty() ? 0 : m_frames.back()->timestamp() - m_frames.front()->timestamp();
+    }
+
+    // one frame made of the pending frames up to a timestamp, nullptr when there is none, the frames taken are appended to taken
+    FramePtr take(std::vector<FramePtr> & taken, uint64_t until = UINT64_MAX) {
+        size_t count = 0;
+        size_t bytes = 0;
+        while (count < m_frames.size() && m_frames[count]->timestamp() <= until) {
+            bytes += m_frames[count]->size();
+            count++;
+        }
+        if (count == 0) {
+            return nullptr;
+        }
+        taken.insert(taken.end(), m_frames.begin(), m_frames.begin() + count);
+        if (count == 1) {
+            FramePtr single = m_frames.front();
+            m_frames.erase(m_frames.begin(), m_frames.begin() + count);
+            return single;
+        }
+
+        const Frame & first = *m_frames.front();
+        std::shared_ptr<Frame> batch = m_pool.acquire(bytes + count * WS_BATCH_ENTRY_HEADER_SIZE);
+        for (size_t i = 0; i < count; ++i) {
+            const Frame & frame = *m_frames[i];
+            unsigned char* entry = batch->extend(WS_BATCH_ENTRY_HEADER_SIZE + frame.size());
+            writeBatchEntryHeader(entry, frame.timestamp(), frame.size());
+            memcpy(entry + WS_BATCH_ENTRY_HEADER_SIZE, frame.data(), frame.size());
+        }
+        batch->setFlags(first.flags() | Frame::BATCH);
+        batch->setTimestamp(first.timestamp());
+
+        // only the binary framing viewers receive batches, they have no JSON metadata
+        unsigned char header[WS_FRAMING_HEADER_SIZE];
+        memcpy(header, first.framed(), WS_FRAMING_HEADER_SIZE);
+        header[2] |= Frame::BATCH;
+        batch->setHeader(header, sizeof(header));
+
+        m_frames.erase(m_frames.begin(), m_frames.begin() + count);
+        return batch;
+    }
+
+    void clear() {
+        m_frames.clear();
+    }
+
+private:
+    FramePool &            m_pool;
+    std::vector<FramePtr>  m_frames;
+};
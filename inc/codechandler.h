@@ -13,33 +13,79 @@
 #pragma once
 
 #include <string>
-#include <iomanip>
+#include <memory>
 
 #include <json/json.h>
 
 #include "session.h"
+#include "framebuffer.h"
+#include "framing.h"
 
 class CodecHandler {
 public:
-    CodecHandler(const SessionParams& params) : m_params(params) {}
+    CodecHandler(const SessionParams& params, FramePool& pool) : m_params(params), m_pool(pool), m_audioParams(true), m_codecId(0) {
+        this->setCodec(params.m_codec);
+    }
 
     virtual ~CodecHandler() = default;
 
-    virtual std::tuple<Json::Value,std::string> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) {
-        Json::Value data;
-        data["media"] = m_params.m_media;
-        data["codec"] = m_params.m_codec;
-        data["freq"] = m_params.m_rtpfrequency;
-        data["channels"] = m_params.m_channels;
-        data["ts"] = Json::Value::UInt64(1000ULL*1000*presentationTime.tv_sec+presentationTime.tv_usec);
-        std::string buf(buffer, buffer+size);        
-        return std::make_tuple(data, buf);
+    virtual std::shared_ptr<Frame> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) {
+        std::shared_ptr<Frame> frame = m_pool.acquire(size);
+        frame->append(buffer, size);
+        this->stamp(*frame, presentationTime, Frame::KEYFRAME);
+        return frame;
     }
 
     virtual bool onConfig(const char* sdp) { 
         return true; 
     }
 
+    const std::string& codec() const { return m_codec; }
+    const std::shared_ptr<const std::string>& descriptor() const { return m_descriptor; }
+
+protected:
+    // video handler computing its codec string from the stream, rtp frequency and channels are not sent
+    CodecHandler(const SessionParams& params, FramePool& pool, const std::string& codec, bool audioParams = false) : m_params(params), m_pool(pool), m_audioParams(audioParams), m_codecId(0) {
+        this->setCodec(codec);
+    }
+
+    // codec string changes rarely, the metadata of the frames is prepared here once
+    void setCodec(const std::string& codec) {
+        if (m_descriptor && (codec == m_codec)) {
+            return;
+        }
+        m_codec = codec;
+        m_codecId++;
+
+        Json::Value data;
+        data["media"] = m_params.m_media;
+        data["codec"] = m_codec;
+        if (m_audioParams) {
+            data["freq"] = m_params.m_rtpfrequency;
+            data["channels"] = m_params.m_channels;
+        }
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        std::string json = Json::writeString(builder, data);
+        m_metaPrefix = json.substr(0, json.size() - 1) + ",\"ts\":";
+
+        data["track"] = m_params.m_track;
+        data["codecid"] = m_codecId;
+        m_descriptor = std::make_shared<const std::string>(Json::writeString(builder, data));
+    }
+
+    // set timestamp, flags, JSON metadata and binary framing header of a frame
+    void stamp(Frame& frame, struct timeval presentationTime, int flags) {
+        uint64_t ts = 1000ULL * 1000 * presentationTime.tv_sec + presentationTime.tv_usec;
+        frame.setFlags(flags);
+        frame.setTimestamp(ts);
+        frame.setMeta(m_metaPrefix, ts, ((flags & Frame::KEYFRAME) && !m_audioParams) ? KEYFRAME_SUFFIX : SUFFIX);
+
+        unsigned char header[WS_FRAMING_HEADER_SIZE];
+        writeFramingHeader(header, m_params.m_track, flags, m_codecId, ts);
+        frame.setHeader(header, sizeof(header));
+    }
+
 protected:
     std::string extractProp(const char* spropvalue) {
         std::string sdpstr(spropvalue);
@@ -62,6 +108,19 @@ protected:
 
 public:
     SessionParams m_params; 
+
+protected:
+    FramePool&    m_pool;
+
+private:
+    inline static const std::string SUFFIX = "}";
+    inline static const std::string KEYFRAME_SUFFIX = ",\"type\":\"keyframe\"}";
+
+    const bool                          m_audioParams;
+    std::string                         m_codec;
+    unsigned char                       m_codecId;
+    std::string                         m_metaPrefix;
+    std::shared_ptr<const std::string>  m_descriptor;
 };
 
 
@@ -0,0 +1,79 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "session.h"
+#include "framebuffer.h"
+#include "codechandler.h"
+#include "h264handler.h"
+#include "h265handler.h"
+
+/*
+ * Handler factories by RTSP media and codec name, resolved once per session.
+ */
+class CodecRegistry {
+public:
+    using Factory = std::function<std::unique_ptr<CodecHandler>(const SessionParams & params, FramePool & pool)>;
+
+    static CodecRegistry & instance() {
+        static CodecRegistry registry;
+        return registry;
+    }
+
+    void add(const std::string & media, const std::string & codec, Factory factory) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_factories[std::make_pair(media, codec)] = factory;
+    }
+
+    // codec forwarded without transformation, published under its websocket codec name
+    void add(const std::string & media, const std::string & codec, const std::string & name) {
+        this->add(media, codec, [name](const SessionParams & params, FramePool & pool) {
+            return std::make_unique<CodecHandler>(SessionParams(params.m_media, name, params.m_rtpfrequency, params.m_channels, params.m_track), pool);
+        });
+    }
+
+    std::unique_ptr<CodecHandler> create(const SessionParams & params, FramePool & pool) {
+        Factory factory;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_factories.find(std::make_pair(params.m_media, params.m_codec));
+            if (it == m_factories.end()) {
+                return nullptr;
+            }
+            factory = it->second;
+        }
+        return factory(params, pool);
+    }
+
+private:
+    CodecRegistry() {
+        this->add("video", "H264", [](const SessionParams & params, FramePool & pool) { return std::make_unique<H264Handler>(params, pool); });
+        this->add("video", "H265", [](const SessionParams & params, FramePool & pool) { return std::make_unique<H265Handler>(params, pool); });
+        this->add("video", "JPEG", "jpeg");
+        this->add("audio", "MPEG4-GENERIC", "mp4a.40.2");
+        this->add("audio", "MPA", "mp3");
+        this->add("audio", "OPUS", "opus");
+        this->add("audio", "PCMU", "ulaw");
+    }
+
+private:
+    std::mutex                                               m_mutex;
+    std::map<std::pair<std::string,std::string>, Factory>    m_factories;
+};
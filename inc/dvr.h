@@ -0,0 +1,397 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+#include <json/json.h>
+
+#include "framebuffer.h"
+#include "framing.h"
+#include "recorder.h"
+#include "wssubscriber.h"
+
+/*
+ * Read-only mapping of the first bytes of a file, the whole file when size is 0.
+ */
+class MappedFile {
+public:
+    MappedFile() : m_data(nullptr), m_size(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { this->close(); }
+
+    bool open(const std::string & path, size_t size) {
+        this->close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            m_size = (size && size < static_cast<size_t>(st.st_size)) ? size : st.st_size;
+        }
+        if (m_size) {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            m_data = (data != MAP_FAILED) ? static_cast<const unsigned char*>(data) : nullptr;
+        }
+        ::close(fd);
+        if (!m_data) {
+            m_size = 0;
+        }
+        return m_data != nullptr;
+#else
+        std::ifstream file(path, std::ios::binary);
+        m_copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (size && size < m_copy.size()) {
+            m_copy.resize(size);
+        }
+        m_data = reinterpret_cast<const unsigned char*>(m_copy.data());
+        m_size = m_copy.size();
+        return file.good() || m_size;
+#endif
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (m_data) {
+            munmap(const_cast<unsigned char*>(m_data), m_size);
+        }
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const unsigned char*  m_data;
+    size_t                m_size;
+#ifdef _WIN32
+    std::string           m_copy;
+#endif
+};
+
+/*
+ * Timeshifted playback of a recorded stream for one viewer, from the last keyframe before a timestamp.
+ * The segment is found by a binary search on the segment start times and the keyframe by a binary search
+ * in its index, mapped from the .idx file or copied from the recorder for the segment being written.
+ * Frames are read from the mapped segments and paced at speed times the real time, when the playback reaches
+ * the end of the recording the viewer switches to live.
+ */
+class DvrPlayer {
+    // a longer gap in the timestamps is skipped instead of waited
+    static constexpr uint64_t MAX_GAP = 2000000;
+
+    struct Segment {
+        uint64_t     m_start;
+        uint64_t     m_bytes;
+        std::string  m_path;
+        bool         m_open;
+    };
+
+    struct Track {
+        std::shared_ptr<const std::string>  m_descriptor;
+        std::string                         m_metaPrefix;
+        bool                                m_video;
+    };
+
+public:
+    DvrPlayer(Recorder & recorder, FramePool & pool, WsSubscriber & subscriber, size_t maxQueue, uint64_t from, double speed, std::function<void()> goLive)
+        : m_recorder(recorder), m_pool(pool), m_subscriber(subscriber), m_maxQueue(maxQueue), m_from(from), m_speed(speed > 0 ? speed : 1.0),
+          m_goLive(goLive), m_position(0), m_stop(false), m_clockTs(0), m_lastTs(0) {
+        m_thread = std::thread([this]() { this->run(); });
+    }
+
+    DvrPlayer(const DvrPlayer&) = delete;
+    DvrPlayer& operator=(const DvrPlayer&) = delete;
+
+    ~DvrPlayer() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+
+    Json::Value toJSON() const {
+        Json::Value json;
+        json["from"] = Json::Value::UInt64(m_from);
+        json["speed"] = m_speed;
+        json["position"] = Json::Value::UInt64(m_position);
+        return json;
+    }
+
+private:
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "dvr");
+#endif
+        Segment segment;
+        std::vector<unsigned char> currentIndex;
+        if (this->locate(m_from, segment, currentIndex)) {
+            uint64_t offset = this->seek(segment, currentIndex, m_from);
+            while (!this->stopped()) {
+                MappedFile file;
+                // size 0 would map the preallocated space of a segment not flushed yet
+                if ((!segment.m_open || segment.m_bytes) && file.open(segment.m_path, segment.m_open ? segment.m_bytes : 0)) {
+                    offset = this->play(file, offset);
+                }
+                if (segment.m_open) {
+                    // more data flushed, the segment closed, or the playback caught up with the recording
+                    Segment current;
+                    if (this->current(current, currentIndex) && current.m_start == segment.m_start) {
+                        if (current.m_bytes <= offset) {
+                            break;
+                        }
+                        segment = current;
+                    } else {
+                        segment.m_open = false;
+                    }
+                } else if (this->next(segment.m_start, segment)) {
+                    offset = RecordFormat::FILE_HEADER_SIZE;
+                } else {
+                    break;
+                }
+            }
+        }
+        if (!this->stopped()) {
+            m_goLive();
+        }
+    }
+
+    bool stopped() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stop;
+    }
+
+    bool current(Segment & segment, std::vector<unsigned char> & index) {
+        Recorder::SegmentInfo info;
+        if (!m_recorder.current(info, index)) {
+            return false;
+        }
+        segment = Segment{info.m_start, info.m_bytes, info.m_path.string(), true};
+        return true;
+    }
+
+    // recorded segments, the one being written last
+    std::vector<Segment> segments(std::vector<unsigned char> & currentIndex) {
+        std::vector<Segment> segments;
+        for (const auto & info : m_recorder.segments()) {
+            segments.push_back(Segment{info.m_start, info.m_bytes, info.m_path.string(), false});
+        }
+        Segment current;
+        if (this->current(current, currentIndex) && (segments.empty() || segments.back().m_start < current.m_start)) {
+            segments.push_back(current);
+        }
+        return segments;
+    }
+
+    // last segment starting before ts, the first one when ts is older
+    bool locate(uint64_t ts, Segment & segment, std::vector<unsigned char> & currentIndex) {
+        std::vector<Segment> segments = this->segments(currentIndex);
+        if (segments.empty()) {
+            return false;
+        }
+        auto it = std::upper_bound(segments.begin(), segments.end(), ts, [](uint64_t ts, const Segment & segment) { return ts < segment.m_start; });
+        segment = (it == segments.begin()) ? *it : *std::prev(it);
+        return true;
+    }
+
+    bool next(uint64_t start, Segment & segment) {
+        std::vector<unsigned char> currentIndex;
+        std::vector<Segment> segments = this->segments(currentIndex);
+        auto it = std::upper_bound(segments.begin(), segments.end(), start, [](uint64_t ts, const Segment & segment) { return ts < segment.m_start; });
+        if (it == segments.end()) {
+            return false;
+        }
+        segment = *it;
+        return true;
+    }
+
+    // offset of the last keyframe before ts, the descriptors written before it are read first
+    uint64_t seek(const Segment & segment, const std::vector<unsigned char> & currentIndex, uint64_t ts) {
+        MappedFile mappedIndex;
+        const unsigned char* index = currentIndex.data();
+        size_t count = currentIndex.size() / RecordFormat::INDEX_ENTRY_SIZE;
+        if (!segment.m_open) {
+            std::string indexPath = std::filesystem::path(segment.m_path).replace_extension(".idx").string();
+            mappedIndex.open(indexPath, 0);
+            index = mappedIndex.data();
+            count = mappedIndex.size() / RecordFormat::INDEX_ENTRY_SIZE;
+        }
+
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (RecordFormat::get64(index + mid * RecordFormat::INDEX_ENTRY_SIZE) <= ts) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low == 0) {
+            return RecordFormat::FILE_HEADER_SIZE;
+        }
+        uint64_t offset = RecordFormat::get64(index + (low - 1) * RecordFormat::INDEX_ENTRY_SIZE + 8);
+
+        MappedFile file;
+        if ((!segment.m_open || segment.m_bytes) && file.open(segment.m_path, segment.m_open ? segment.m_bytes : 0)) {
+            this->readDescriptors(file, offset);
+        }
+        return offset;
+    }
+
+    // descriptors of the records before the playback offset, a codec may have changed within the segment
+    void readDescriptors(const MappedFile & file, uint64_t until) {
+        uint64_t offset = RecordFormat::FILE_HEADER_SIZE;
+        while (offset < until && offset + RecordFormat::RECORD_HEADER_SIZE <= file.size()) {
+            const unsigned char* header = file.data() + offset;
+            uint32_t size = RecordFormat::get32(header);
+            if (offset + RecordFormat::RECORD_HEADER_SIZE + size > file.size()) {
+                break;
+            }
+            if (header[4] == RecordFormat::DESCRIPTOR) {
+                this->setDescriptor(std::string(reinterpret_cast<const char*>(header + RecordFormat::RECORD_HEADER_SIZE), size));
+            }
+            offset += RecordFormat::RECORD_HEADER_SIZE + size;
+        }
+    }
+
+    // JSON metadata of the frames built like the codec handler did from the descriptor
+    void setDescriptor(const std::string & descriptor) {
+        Json::Value json;
+        Json::CharReaderBuilder builder;
+        std::string errors;
+        std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        if (!reader->parse(descriptor.data(), descriptor.data() + descriptor.size(), &json, &errors)) {
+            return;
+        }
+        Track & track = m_tracks[json["track"].asUInt()];
+        track.m_descriptor = std::make_shared<const std::string>(descriptor);
+        track.m_video = (json["media"].asString() == "video");
+        json.removeMember("track");
+        json.removeMember("codecid");
+        Json::StreamWriterBuilder writer;
+        writer["indentation"] = "";
+        std::string meta = Json::writeString(writer, json);
+        track.m_metaPrefix = meta.substr(0, meta.size() - 1) + ",\"ts\":";
+    }
+
+    // send the complete records from offset, returns the offset of the first record not sent
+    uint64_t play(const MappedFile & file, uint64_t offset) {
+        while (offset + RecordFormat::RECORD_HEADER_SIZE <= file.size() && !this->stopped()) {
+            const unsigned char* header = file.data() + offset;
+            uint32_t size = RecordFormat::get32(header);
+            if (offset + RecordFormat::RECORD_HEADER_SIZE + size > file.size()) {
+                break;
+            }
+            const unsigned char* payload = header + RecordFormat::RECORD_HEADER_SIZE;
+            if (header[4] == RecordFormat::DESCRIPTOR) {
+                this->setDescriptor(std::string(reinterpret_cast<const char*>(payload), size));
+            } else if (header[4] == RecordFormat::FRAME && size >= WS_FRAMING_HEADER_SIZE) {
+                this->send(payload, size);
+            }
+            offset += RecordFormat::RECORD_HEADER_SIZE + size;
+        }
+        return offset;
+    }
+
+    void send(const unsigned char* framed, size_t size) {
+        auto it = m_tracks.find(framed[1]);
+        if (it == m_tracks.end()) {
+            return;
+        }
+        const Track & track = it->second;
+        uint64_t ts = 0;
+        for (int i = 7; i >= 0; --i) {
+            ts = (ts << 8) | framed[8 + i];
+        }
+        int flags = framed[2];
+        this->pace(ts);
+
+        std::shared_ptr<Frame> frame = m_pool.acquire(size - WS_FRAMING_HEADER_SIZE);
+        frame->append(framed + WS_FRAMING_HEADER_SIZE, size - WS_FRAMING_HEADER_SIZE);
+        frame->setFlags(flags);
+        frame->setTimestamp(ts);
+        frame->setHeader(framed, WS_FRAMING_HEADER_SIZE);
+        frame->setMeta(track.m_metaPrefix, ts, ((flags & Frame::KEYFRAME) && track.m_video) ? ",\"type\":\"keyframe\"}" : "}");
+
+        WsMessage msg;
+        msg.m_frame = frame;
+        msg.m_video = track.m_video;
+        msg.m_track = framed[1];
+        msg.m_descriptor = track.m_descriptor;
+        msg.m_published = std::chrono::steady_clock::now();
+        m_subscriber.push(msg);
+        m_position = ts;
+    }
+
+    // wait the time of the frame at the playback speed, and for room in the queue of the viewer
+    void pace(uint64_t ts) {
+        auto now = std::chrono::steady_clock::now();
+        if (!m_clockTs || ts < m_lastTs || ts - m_lastTs > MAX_GAP) {
+            m_clock = now;
+            m_clockTs = ts;
+        }
+        m_lastTs = ts;
+        auto due = m_clock + std::chrono::microseconds(static_cast<uint64_t>((ts - m_clockTs) / m_speed));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait_until(lock, due, [this]() { return m_stop; });
+        while (!m_stop && m_subscriber.queued() >= m_maxQueue / 2) {
+            m_cond.wait_for(lock, std::chrono::milliseconds(10), [this]() { return m_stop; });
+        }
+    }
+
+private:
+    Recorder &                              m_recorder;
+    FramePool &                             m_pool;
+    WsSubscriber &                          m_subscriber;
+    const size_t                            m_maxQueue;
+    const uint64_t                          m_from;
+    const double                            m_speed;
+    std::function<void()>                   m_goLive;
+    std::atomic<uint64_t>                   m_position;
+    std::map<unsigned char,Track>           m_tracks;
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_cond;
+    bool                                    m_stop;
+    std::chrono::steady_clock::time_point   m_clock;
+    uint64_t                                m_clockTs;
+    uint64_t                                m_lastTs;
+    std::thread                             m_thread;
+};
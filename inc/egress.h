@@ -0,0 +1,308 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include <json/json.h>
+
+#include "metrics.h"
+
+/*
+ * Share of a stream in the egress budget, selected with "priority" and "weight" in its configuration.
+ * The stream counts the bytes it queues to its websocket viewers, the essential bytes being the audio
+ * and the keyframes that are still sent when the scheduler limits its video to the keyframes.
+ */
+class EgressShare {
+public:
+    EgressShare(const std::string & name, unsigned int priority, double weight, const Counter & sent)
+        : m_name(name), m_priority(priority), m_weight(weight > 0 ? weight : 1.0), m_sent(sent), m_keyframes(false),
+          m_lastOffered(0), m_lastEssential(0), m_lastSent(0), m_demand(0), m_essentialDemand(0), m_rate(0), m_allocation(0),
+          m_degraded(0), m_heldPeriods(0) {}
+
+    void offer(uint64_t bytes, bool essential) {
+        m_offered.add(bytes);
+        if (essential) {
+            m_essential.add(bytes);
+        }
+    }
+
+    bool keyframes() const { return m_keyframes.load(std::memory_order_relaxed); }
+
+    unsigned int priority() const { return m_priority; }
+    double weight() const { return m_weight; }
+
+    Json::Value toJSON() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Json::Value json;
+        json["priority"] = m_priority;
+        json["weight"] = m_weight;
+        json["mode"] = this->keyframes() ? "keyframes" : "full";
+        json["demand"] = m_demand;
+        json["keyframesDemand"] = m_essentialDemand;
+        json["allocation"] = m_allocation;
+        json["bitrate"] = m_rate;
+        json["degraded"] = Json::Value::UInt64(m_degraded);
+        return json;
+    }
+
+private:
+    friend class EgressScheduler;
+
+    const std::string      m_name;
+    const unsigned int     m_priority;
+    const double           m_weight;
+    const Counter &        m_sent;
+    Counter                m_offered;
+    Counter                m_essential;
+    std::atomic<bool>      m_keyframes;
+
+    // updated by the scheduler, rates in bits per second
+    mutable std::mutex     m_mutex;
+    uint64_t               m_lastOffered;
+    uint64_t               m_lastEssential;
+    uint64_t               m_lastSent;
+    double                 m_demand;
+    double                 m_essentialDemand;
+    double                 m_rate;
+    double                 m_allocation;
+    unsigned long long     m_degraded;
+    unsigned int           m_heldPeriods;
+};
+
+/*
+ * Global egress budget of the websocket viewers, in bits per second, shared by the streams every period.
+ * Each priority level gets what the higher levels left once the lower levels are reduced to their keyframes,
+ * the streams of a level share it in proportion to their weight : a stream whose share is below its demand is
+ * limited to its keyframes. Lower priorities are therefore degraded before the higher ones are touched.
+ * Demands are the smoothed bitrates offered to the viewers, a degraded stream is restored after being held
+ * for a few periods and once its demand fits with a margin, so a stream does not flap around the limit.
+ */
+class EgressScheduler {
+    static constexpr std::chrono::milliseconds PERIOD = std::chrono::milliseconds(1000);
+    static constexpr double SMOOTHING = 0.25;
+    static constexpr double RESTORE_MARGIN = 1.1;
+    static constexpr unsigned int HOLD_PERIODS = 5;
+
+public:
+    // budget in bits per second, 0 leaves the egress unlimited
+    explicit EgressScheduler(double budget) : m_budget(budget), m_demand(0), m_allocated(0), m_stop(false) {
+        if (m_budget > 0) {
+            m_thread = std::thread([this]() { this->run(); });
+        }
+    }
+
+    EgressScheduler(const EgressScheduler&) = delete;
+    EgressScheduler& operator=(const EgressScheduler&) = delete;
+
+    ~EgressScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void add(EgressShare* share) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        share->m_lastOffered = share->m_offered.value();
+        share->m_lastEssential = share->m_essential.value();
+        share->m_lastSent = share->m_sent.value();
+        m_shares.push_back(share);
+    }
+
+    void remove(EgressShare* share) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shares.erase(std::remove(m_shares.begin(), m_shares.end(), share), m_shares.end());
+    }
+
+    Json::Value toJSON() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Json::Value json;
+        json["budget"] = m_budget;
+        json["demand"] = m_demand;
+        json["allocated"] = m_allocated;
+        Json::Value degraded(Json::arrayValue);
+        for (const EgressShare* share : m_shares) {
+            if (share->keyframes()) {
+                degraded.append(share->m_name);
+            }
+        }
+        json["keyframes"] = degraded;
+        return json;
+    }
+
+    void write(PrometheusWriter & writer) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        writer.gauge("rtsp2ws_egress_budget_bits", "Egress budget of the websocket viewers in bits per second", "", m_budget);
+        writer.gauge("rtsp2ws_egress_demand_bits", "Bitrate offered to the websocket viewers", "", m_demand);
+        for (const EgressShare* share : m_shares) {
+            std::string labels = PrometheusWriter::label("stream", share->m_name);
+            std::lock_guard<std::mutex> shareLock(share->m_mutex);
+            writer.gauge("rtsp2ws_egress_allocation_bits", "Egress allocated to a stream in bits per second", labels, share->m_allocation);
+            writer.gauge("rtsp2ws_egress_keyframes", "Stream limited to its keyframes by the egress budget", labels, share->keyframes() ? 1 : 0);
+        }
+    }
+
+private:
+    struct Entry {
+        EgressShare*  m_share;
+        double        m_cap;        // bitrate above which the stream is not full
+        double        m_floor;      // bitrate of its keyframes
+        double        m_allocation;
+    };
+
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "egress");
+#endif
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto last = std::chrono::steady_clock::now();
+        while (!m_cond.wait_for(lock, PERIOD, [this]() { return m_stop; })) {
+            auto now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - last).count();
+            last = now;
+            if (elapsed > 0) {
+                this->schedule(elapsed);
+            }
+        }
+    }
+
+    // called with m_mutex held
+    void schedule(double elapsed) {
+        std::vector<Entry> entries;
+        m_demand = 0;
+        for (EgressShare* share : m_shares) {
+            std::lock_guard<std::mutex> lock(share->m_mutex);
+            uint64_t offered = share->m_offered.value();
+            uint64_t essential = share->m_essential.value();
+            uint64_t sent = share->m_sent.value();
+            share->m_demand = smooth(share->m_demand, (offered - share->m_lastOffered) * 8 / elapsed);
+            share->m_essentialDemand = smooth(share->m_essentialDemand, (essential - share->m_lastEssential) * 8 / elapsed);
+            share->m_rate = (sent - share->m_lastSent) * 8 / elapsed;
+            share->m_lastOffered = offered;
+            share->m_lastEssential = essential;
+            share->m_lastSent = sent;
+            m_demand += share->m_demand;
+
+            Entry entry;
+            entry.m_share = share;
+            entry.m_floor = std::min(share->m_essentialDemand, share->m_demand);
+            entry.m_cap = share->m_demand;
+            if (share->keyframes()) {
+                share->m_heldPeriods++;
+                entry.m_cap = (share->m_heldPeriods < HOLD_PERIODS) ? entry.m_floor : share->m_demand * RESTORE_MARGIN;
+            }
+            entry.m_allocation = entry.m_floor;
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) { return a.m_share->priority() > b.m_share->priority(); });
+
+        // each level shares what is left with the lower levels at their keyframes
+        double left = m_budget;
+        for (const Entry & entry : entries) {
+            left -= entry.m_floor;
+        }
+        size_t level = 0;
+        while (level < entries.size()) {
+            size_t end = level;
+            while (end < entries.size() && entries[end].m_share->priority() == entries[level].m_share->priority()) {
+                left += entries[end].m_floor;
+                end++;
+            }
+            left -= fill(entries, level, end, left);
+            level = end;
+        }
+
+        m_allocated = 0;
+        for (Entry & entry : entries) {
+            EgressShare* share = entry.m_share;
+            std::lock_guard<std::mutex> lock(share->m_mutex);
+            bool degraded = entry.m_allocation < entry.m_cap || (share->keyframes() && share->m_heldPeriods < HOLD_PERIODS);
+            // the video is full or limited to its keyframes, a partial share is not usable
+            share->m_allocation = degraded ? entry.m_floor : share->m_demand;
+            if (degraded && !share->keyframes()) {
+                share->m_degraded++;
+                share->m_heldPeriods = 0;
+            }
+            share->m_keyframes.store(degraded, std::memory_order_relaxed);
+            m_allocated += share->m_allocation;
+        }
+    }
+
+    // weighted max-min share of a level between the keyframes and the demand of its streams, returns the bitrate used
+    static double fill(std::vector<Entry> & entries, size_t begin, size_t end, double available) {
+        double floors = 0;
+        double caps = 0;
+        double ceiling = 0;
+        for (size_t i = begin; i < end; ++i) {
+            floors += entries[i].m_floor;
+            caps += entries[i].m_cap;
+            ceiling = std::max(ceiling, entries[i].m_cap / entries[i].m_share->weight());
+        }
+        if (caps <= available) {
+            for (size_t i = begin; i < end; ++i) {
+                entries[i].m_allocation = entries[i].m_cap;
+            }
+            return caps;
+        }
+        if (floors >= available) {
+            return floors;
+        }
+        // bitrate per unit of weight filling the available budget
+        double low = 0;
+        double high = ceiling;
+        for (int iteration = 0; iteration < 50; ++iteration) {
+            double level = (low + high) / 2;
+            double used = 0;
+            for (size_t i = begin; i < end; ++i) {
+                used += std::clamp(level * entries[i].m_share->weight(), entries[i].m_floor, entries[i].m_cap);
+            }
+            (used > available ? high : low) = level;
+        }
+        double used = 0;
+        for (size_t i = begin; i < end; ++i) {
+            entries[i].m_allocation = std::clamp(low * entries[i].m_share->weight(), entries[i].m_floor, entries[i].m_cap);
+            used += entries[i].m_allocation;
+        }
+        return used;
+    }
+
+    static double smooth(double value, double sample) {
+        return value + SMOOTHING * (sample - value);
+    }
+
+private:
+    const double                 m_budget;
+    std::mutex                   m_mutex;
+    std::condition_variable      m_cond;
+    std::vector<EgressShare*>    m_shares;
+    double                       m_demand;
+    double                       m_allocated;
+    bool                         m_stop;
+    std::thread                  m_thread;
+};
@@ -0,0 +1,177 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <ctime>
+
+#include <json/json.h>
+
+#include "rtspconnectionclient.h"
+#include "metrics.h"
+
+/*
+ * A live555 environment with the thread running its scheduler.
+ * invoke() is the thread safe way to run code on the loop, it uses a live555 event trigger.
+ */
+class EventLoop {
+public:
+    EventLoop(const std::string & name) : m_name(name), m_streams(0) {
+        m_trigger = m_env.taskScheduler().createEventTrigger(EventLoop::onTrigger);
+        m_thread = std::thread([this]() {
+#ifndef _WIN32
+            pthread_setname_np(pthread_self(), m_name.c_str());
+#endif
+            m_env.mainloop();
+        });
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        m_env.stop();
+        m_thread.join();
+        m_env.taskScheduler().deleteEventTrigger(m_trigger);
+    }
+
+    Environment& env() { return m_env; }
+
+    // run the function on the loop thread and wait for its completion
+    void invoke(std::function<void()> func) {
+        if (std::this_thread::get_id() == m_thread.get_id()) {
+            func();
+            return;
+        }
+        std::packaged_task<void()> task(std::move(func));
+        std::future<void> done = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_env.taskScheduler().triggerEvent(m_trigger, this);
+        done.wait();
+    }
+
+    unsigned int streams() const { return m_streams; }
+
+    const std::string & name() const { return m_name; }
+
+    // CPU time consumed by the loop thread
+    double cpuTime() {
+#ifndef _WIN32
+        clockid_t clock;
+        struct timespec ts;
+        if ((pthread_getcpuclockid(m_thread.native_handle(), &clock) == 0) && (clock_gettime(clock, &ts) == 0)) {
+            return ts.tv_sec + ts.tv_nsec / 1e9;
+        }
+#endif
+        return 0;
+    }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        json["name"] = m_name;
+        json["streams"] = m_streams;
+        json["cpu"] = this->cpuTime();
+        return json;
+    }
+
+private:
+    friend class EventLoopPool;
+
+    static void onTrigger(void* clientData) {
+        EventLoop* loop = static_cast<EventLoop*>(clientData);
+        std::vector<std::packaged_task<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(loop->m_mutex);
+            tasks.swap(loop->m_tasks);
+        }
+        for (auto & task : tasks) {
+            task();
+        }
+    }
+
+private:
+    const std::string                         m_name;
+    Environment                               m_env;
+    EventTriggerId                            m_trigger;
+    std::mutex                                m_mutex;
+    std::vector<std::packaged_task<void()>>   m_tasks;
+    unsigned int                              m_streams;
+    std::thread                               m_thread;
+};
+
+/*
+ * Fixed set of event loops shared by all the streams, a new stream goes to the least loaded loop.
+ */
+class EventLoopPool {
+public:
+    EventLoopPool(unsigned int nbLoops) {
+        if (nbLoops == 0) {
+            nbLoops = std::max(1U, std::thread::hardware_concurrency());
+        }
+        for (unsigned int i = 0; i < nbLoops; ++i) {
+            m_loops.push_back(std::make_unique<EventLoop>("live555-" + std::to_string(i)));
+        }
+    }
+
+    EventLoopPool(const EventLoopPool&) = delete;
+    EventLoopPool& operator=(const EventLoopPool&) = delete;
+
+    EventLoop& acquire() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        EventLoop* selected = m_loops.front().get();
+        for (auto & loop : m_loops) {
+            if (loop->m_streams < selected->m_streams) {
+                selected = loop.get();
+            }
+        }
+        selected->m_streams++;
+        return *selected;
+    }
+
+    void release(EventLoop& loop) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        loop.m_streams--;
+    }
+
+    Json::Value toJSON() {
+        Json::Value json(Json::arrayValue);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto & loop : m_loops) {
+            json.append(loop->toJSON());
+        }
+        return json;
+    }
+
+    void write(PrometheusWriter & writer) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto & loop : m_loops) {
+            std::string labels = PrometheusWriter::label("loop", loop->name());
+            writer.counter("rtsp2ws_loop_cpu_seconds_total", "CPU time of the RTSP event loop threads", labels, loop->cpuTime());
+            writer.gauge("rtsp2ws_loop_streams", "Streams handled by the RTSP event loop", labels, loop->streams());
+        }
+    }
+
+private:
+    std::mutex                               m_mutex;
+    std::vector<std::unique_ptr<EventLoop>>  m_loops;
+};
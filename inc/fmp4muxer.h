@@ -0,0 +1,529 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "framebuffer.h"
+
+/*
+ * Exp-Golomb reader over a RBSP, reads past the end return zeros.
+ */
+class BitReader {
+public:
+    BitReader(const std::string& data, size_t offset) : m_data(data), m_pos(offset * 8) {}
+
+    uint32_t bit() {
+        size_t byte = m_pos / 8;
+        uint32_t value = (byte < m_data.size()) ? (static_cast<unsigned char>(m_data[byte]) >> (7 - m_pos % 8)) & 1 : 0;
+        m_pos++;
+        return value;
+    }
+
+    uint32_t bits(int count) {
+        uint32_t value = 0;
+        while (count-- > 0) {
+            value = (value << 1) | bit();
+        }
+        return value;
+    }
+
+    void skip(size_t count) { m_pos += count; }
+
+    uint32_t ue() {
+        int zeros = 0;
+        while (bit() == 0 && zeros < 32) {
+            zeros++;
+        }
+        return ((1ULL << zeros) - 1) + bits(zeros);
+    }
+
+    int32_t se() {
+        uint32_t value = ue();
+        return (value & 1) ? (value + 1) / 2 : -static_cast<int32_t>(value / 2);
+    }
+
+private:
+    const std::string& m_data;
+    size_t             m_pos;
+};
+
+/*
+ * ISO BMFF boxes written in a string, sizes are patched when a box is closed.
+ */
+class BoxWriter {
+public:
+    void u8(uint8_t value) { m_data.push_back(static_cast<char>(value)); }
+    void u16(uint16_t value) { u8(value >> 8); u8(value); }
+    void u32(uint32_t value) { u16(value >> 16); u16(value); }
+    void u64(uint64_t value) { u32(value >> 32); u32(value); }
+    void zeros(size_t count) { m_data.append(count, '\0'); }
+    void bytes(const std::string& value) { m_data += value; }
+
+    size_t open(const char* type) {
+        size_t offset = m_data.size();
+        u32(0);
+        m_data.append(type, 4);
+        return offset;
+    }
+
+    size_t open(const char* type, uint8_t version, uint32_t flags) {
+        size_t offset = open(type);
+        u32((version << 24) | flags);
+        return offset;
+    }
+
+    void close(size_t offset) {
+        uint32_t size = m_data.size() - offset;
+        for (int i = 0; i < 4; ++i) {
+            m_data[offset + i] = static_cast<char>(size >> (24 - 8 * i));
+        }
+    }
+
+    const std::string& str() const { return m_data; }
+
+private:
+    std::string m_data;
+};
+
+/*
+ * Packages H.264/H.265 access units in fragmented MP4 (CMAF) for Media Source Extensions.
+ * The init segment is rebuilt from the parameter sets carried in front of the keyframes,
+ * each access unit becomes one moof+mdat fragment written in a pooled frame, Annex-B start codes
+ * replaced by NAL unit lengths. One muxer runs per track, its output is shared by all the viewers.
+ */
+class Fmp4Muxer {
+    static constexpr uint32_t TIMESCALE = 90000;
+    static constexpr uint32_t DEFAULT_DURATION = TIMESCALE / 25;
+    static constexpr size_t   START_CODE_SIZE = 4;
+    // moof(mfhd, traf(tfhd, tfdt, trun with one sample)) + mdat header
+    static constexpr size_t   FRAGMENT_HEADER_SIZE = 8 + 16 + 8 + 16 + 20 + 32 + 8;
+
+public:
+    Fmp4Muxer(bool h265, FramePool& pool) : m_h265(h265), m_pool(pool), m_sequence(0), m_firstTs(0), m_lastTs(0), m_duration(DEFAULT_DURATION) {}
+
+    // init segment, null until the parameter sets are known
+    const std::shared_ptr<const std::string>& init() const { return m_init; }
+
+    // one fragment for an access unit, nullptr while waiting for the first keyframe
+    std::shared_ptr<Frame> fragment(const Frame& au) {
+        if (!m_init && !au.isKeyFrame()) {
+            return nullptr;
+        }
+        std::shared_ptr<Frame> fragment = m_pool.acquire(FRAGMENT_HEADER_SIZE + au.size());
+        unsigned char* header = fragment->extend(FRAGMENT_HEADER_SIZE);
+
+        // copy the NAL units with a length prefix, parameter sets go to the init segment
+        bool paramSetsChanged = false;
+        const unsigned char* data = au.data();
+        size_t size = au.size();
+        size_t pos = nextStartCode(data, size, 0);
+        while (pos < size) {
+            size_t start = pos + 3;
+            size_t end = nextStartCode(data, size, start);
+            size_t next = end;
+            if (end < size && end > start && data[end - 1] == 0) {
+                end--;
+            }
+            if (end > start) {
+                paramSetsChanged |= this->onNal(*fragment, data + start, end - start);
+            }
+            pos = next;
+        }
+
+        if (paramSetsChanged || !m_init) {
+            this->buildInit();
+            if (!m_init) {
+                return nullptr;
+            }
+        }
+
+        uint64_t ts = au.timestamp();
+        if (m_sequence == 0) {
+            m_firstTs = ts;
+        } else if (ts > m_lastTs) {
+            m_duration = (ts - m_lastTs) * TIMESCALE / 1000000;
+        }
+        m_lastTs = ts;
+        uint64_t decodeTime = (ts >= m_firstTs) ? (ts - m_firstTs) * TIMESCALE / 1000000 : 0;
+        this->writeFragmentHeader(header, ++m_sequence, decodeTime, fragment->size() - FRAGMENT_HEADER_SIZE, au.isKeyFrame());
+
+        fragment->setFlags(au.flags());
+        fragment->setTimestamp(ts);
+        fragment->setHeader(nullptr, 0);
+        return fragment;
+    }
+
+private:
+    static size_t nextStartCode(const unsigned char* data, size_t size, size_t pos) {
+        while (pos + 3 <= size) {
+            const unsigned char* one = static_cast<const unsigned char*>(memchr(data + pos + 2, 1, size - pos - 2));
+            if (!one) {
+                break;
+            }
+            size_t idx = one - data;
+            if (one[-1] == 0 && one[-2] == 0) {
+                return idx - 2;
+            }
+            pos = idx - 1;
+        }
+        return size;
+    }
+
+    bool store(std::string& paramSet, const unsigned char* nal, size_t size) {
+        if (paramSet.size() == size && memcmp(paramSet.data(), nal, size) == 0) {
+            return false;
+        }
+        paramSet.assign(reinterpret_cast<const char*>(nal), size);
+        return true;
+    }
+
+    bool onNal(Frame& fragment, const unsigned char* nal, size_t size) {
+        int type = m_h265 ? (nal[0] >> 1) & 0x3f : nal[0] & 0x1f;
+        if (m_h265) {
+            switch (type) {
+                case 32: return store(m_vps, nal, size);
+                case 33: return store(m_sps, nal, size);
+                case 34: return store(m_pps, nal, size);
+                case 35: return false;  // access unit delimiter
+            }
+        } else {
+            switch (type) {
+                case 7: return store(m_sps, nal, size);
+                case 8: return store(m_pps, nal, size);
+                case 9: return false;   // access unit delimiter
+            }
+        }
+        unsigned char* ptr = fragment.extend(START_CODE_SIZE + size);
+        if (ptr) {
+            writeU32(ptr, size);
+            memcpy(ptr + START_CODE_SIZE, nal, size);
+        }
+        return false;
+    }
+
+    static void writeU32(unsigned char* ptr, uint32_t value) {
+        ptr[0] = value >> 24;
+        ptr[1] = value >> 16;
+        ptr[2] = value >> 8;
+        ptr[3] = value;
+    }
+
+    static unsigned char* box(unsigned char* ptr, uint32_t size, const char* type) {
+        writeU32(ptr, size);
+        memcpy(ptr + 4, type, 4);
+        return ptr + 8;
+    }
+
+    void writeFragmentHeader(unsigned char* ptr, uint32_t sequence, uint64_t decodeTime, uint32_t sampleSize, bool keyframe) {
+        const uint32_t moofSize = FRAGMENT_HEADER_SIZE - 8;
+        ptr = box(ptr, moofSize, "moof");
+        ptr = box(ptr, 16, "mfhd");
+        writeU32(ptr, 0); writeU32(ptr + 4, sequence); ptr += 8;
+        ptr = box(ptr, 8 + 16 + 20 + 32, "traf");
+        ptr = box(ptr, 16, "tfhd");
+        writeU32(ptr, 0x020000); writeU32(ptr + 4, 1); ptr += 8;                     // default-base-is-moof, track 1
+        ptr = box(ptr, 20, "tfdt");
+        writeU32(ptr, 0x01000000); writeU32(ptr + 4, decodeTime >> 32); writeU32(ptr + 8, decodeTime); ptr += 12;
+        ptr = box(ptr, 32, "trun");
+        writeU32(ptr, 0x000701); writeU32(ptr + 4, 1); writeU32(ptr + 8, FRAGMENT_HEADER_SIZE); ptr += 12;   // offset, duration, size, flags
+        writeU32(ptr, m_duration); writeU32(ptr + 4, sampleSize); writeU32(ptr + 8, keyframe ? 0x02000000 : 0x01010000); ptr += 12;
+        box(ptr, 8 + sampleSize, "mdat");
+    }
+
+    static std::string rbsp(const std::string& nal) {
+        std::string out;
+        out.reserve(nal.size());
+        int zeros = 0;
+        for (unsigned char c : nal) {
+            if (zeros >= 2 && c == 3) {
+                zeros = 0;
+                continue;
+            }
+            zeros = (c == 0) ? zeros + 1 : 0;
+            out.push_back(static_cast<char>(c));
+        }
+        return out;
+    }
+
+    struct VideoInfo {
+        uint32_t m_width = 0;
+        uint32_t m_height = 0;
+        uint32_t m_chromaFormat = 1;
+        uint32_t m_bitDepthLuma = 8;
+        uint32_t m_bitDepthChroma = 8;
+    };
+
+    static void skipScalingList(BitReader& bits, int size) {
+        int last = 8, next = 8;
+        for (int i = 0; i < size; ++i) {
+            if (next != 0) {
+                next = (last + bits.se() + 256) % 256;
+            }
+            last = (next == 0) ? last : next;
+        }
+    }
+
+    // picture size of a H.264 SPS (ITU-T H.264 7.3.2.1.1)
+    static VideoInfo parseH264Sps(const std::string& sps) {
+        VideoInfo info;
+        std::string data = rbsp(sps);
+        BitReader bits(data, 1);
+        uint32_t profile = bits.bits(8);
+        bits.skip(16);
+        bits.ue();
+        if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83
+            || profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 || profile == 135) {
+            info.m_chromaFormat = bits.ue();
+            if (info.m_chromaFormat == 3) {
+                bits.skip(1);
+            }
+            info.m_bitDepthLuma = 8 + bits.ue();
+            info.m_bitDepthChroma = 8 + bits.ue();
+            bits.skip(1);
+            if (bits.bit()) {
+                for (int i = 0; i < ((info.m_chromaFormat != 3) ? 8 : 12); ++i) {
+                    if (bits.bit()) {
+                        skipScalingList(bits, (i < 6) ? 16 : 64);
+                    }
+                }
+            }
+        }
+        bits.ue();
+        uint32_t pocType = bits.ue();
+        if (pocType == 0) {
+            bits.ue();
+        } else if (pocType == 1) {
+            bits.skip(1);
+            bits.se();
+            bits.se();
+            uint32_t cycle = bits.ue();
+            for (uint32_t i = 0; i < cycle && i < 256; ++i) {
+                bits.se();
+            }
+        }
+        bits.ue();
+        bits.skip(1);
+        uint32_t widthInMbs = bits.ue() + 1;
+        uint32_t heightInMapUnits = bits.ue() + 1;
+        uint32_t frameMbsOnly = bits.bit();
+        if (!frameMbsOnly) {
+            bits.skip(1);
+        }
+        bits.skip(1);
+        info.m_width = widthInMbs * 16;
+        info.m_height = (2 - frameMbsOnly) * heightInMapUnits * 16;
+        if (bits.bit()) {
+            uint32_t cropX = (info.m_chromaFormat == 1 || info.m_chromaFormat == 2) ? 2 : 1;
+            uint32_t cropY = ((info.m_chromaFormat == 1) ? 2 : 1) * (2 - frameMbsOnly);
+            uint32_t left = bits.ue(), right = bits.ue(), top = bits.ue(), bottom = bits.ue();
+            info.m_width -= (left + right) * cropX;
+            info.m_height -= (top + bottom) * cropY;
+        }
+        return info;
+    }
+
+    // picture size of a H.265 SPS (ITU-T H.265 7.3.2.2.1)
+    static VideoInfo parseH265Sps(const std::string& sps) {
+        VideoInfo info;
+        std::string data = rbsp(sps);
+        BitReader bits(data, 2);
+        bits.skip(4);
+        uint32_t maxSubLayersMinus1 = bits.bits(3);
+        bits.skip(1);
+        bits.skip(96);
+        std::vector<std::pair<bool,bool>> subLayers;
+        for (uint32_t i = 0; i < maxSubLayersMinus1; ++i) {
+            bool profile = bits.bit();
+            bool level = bits.bit();
+            subLayers.push_back(std::make_pair(profile, level));
+        }
+        if (maxSubLayersMinus1 > 0) {
+            bits.skip(2 * (8 - maxSubLayersMinus1));
+        }
+        for (auto & subLayer : subLayers) {
+            bits.skip((subLayer.first ? 88 : 0) + (subLayer.second ? 8 : 0));
+        }
+        bits.ue();
+        info.m_chromaFormat = bits.ue();
+        if (info.m_chromaFormat == 3) {
+            bits.skip(1);
+        }
+        info.m_width = bits.ue();
+        info.m_height = bits.ue();
+        if (bits.bit()) {
+            uint32_t cropX = (info.m_chromaFormat == 1 || info.m_chromaFormat == 2) ? 2 : 1;
+            uint32_t cropY = (info.m_chromaFormat == 1) ? 2 : 1;
+            uint32_t left = bits.ue(), right = bits.ue(), top = bits.ue(), bottom = bits.ue();
+            info.m_width -= (left + right) * cropX;
+            info.m_height -= (top + bottom) * cropY;
+        }
+        info.m_bitDepthLuma = 8 + bits.ue();
+        info.m_bitDepthChroma = 8 + bits.ue();
+        return info;
+    }
+
+    // ISO/IEC 14496-15 5.3.3.1
+    void writeAvcC(BoxWriter& out) {
+        size_t avcC = out.open("avcC");
+        out.u8(1);
+        out.u8(m_sps[1]);
+        out.u8(m_sps[2]);
+        out.u8(m_sps[3]);
+        out.u8(0xFF);       // 4 bytes NAL unit length
+        out.u8(0xE1);       // 1 SPS
+        out.u16(m_sps.size());
+        out.bytes(m_sps);
+        out.u8(1);
+        out.u16(m_pps.size());
+        out.bytes(m_pps);
+        out.close(avcC);
+    }
+
+    // ISO/IEC 14496-15 8.3.3.1
+    void writeHvcC(BoxWriter& out, const VideoInfo& info) {
+        std::string sps = rbsp(m_sps);
+        size_t hvcC = out.open("hvcC");
+        out.u8(1);
+        for (size_t i = 3; i < 15; ++i) {      // general profile_tier_level
+            out.u8((i < sps.size()) ? sps[i] : 0);
+        }
+        out.u16(0xF000);                       // min_spatial_segmentation_idc
+        out.u8(0xFC);                          // parallelismType
+        out.u8(0xFC | info.m_chromaFormat);
+        out.u8(0xF8 | (info.m_bitDepthLuma - 8));
+        out.u8(0xF8 | (info.m_bitDepthChroma - 8));
+        out.u16(0);                            // avgFrameRate
+        out.u8(0x0F);                          // 1 temporal layer, nested, 4 bytes NAL unit length
+        out.u8(3);
+        const std::string* paramSets[] = { &m_vps, &m_sps, &m_pps };
+        const uint8_t types[] = { 32, 33, 34 };
+        for (int i = 0; i < 3; ++i) {
+            out.u8(0x80 | types[i]);
+            out.u16(1);
+            out.u16(paramSets[i]->size());
+            out.bytes(*paramSets[i]);
+        }
+        out.close(hvcC);
+    }
+
+    void buildInit() {
+        if (m_sps.size() < 4 || m_pps.empty() || (m_h265 && m_vps.empty())) {
+            return;
+        }
+        VideoInfo info = m_h265 ? parseH265Sps(m_sps) : parseH264Sps(m_sps);
+        const uint32_t matrix[] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+        BoxWriter out;
+
+        size_t ftyp = out.open("ftyp");
+        out.bytes("iso5");
+        out.u32(512);
+        out.bytes("iso5iso6mp41");
+        out.close(ftyp);
+
+        size_t moov = out.open("moov");
+        size_t mvhd = out.open("mvhd", 0, 0);
+        out.u32(0); out.u32(0); out.u32(1000); out.u32(0);
+        out.u32(0x00010000); out.u16(0x0100); out.zeros(10);
+        for (uint32_t value : matrix) out.u32(value);
+        out.zeros(24);
+        out.u32(2);
+        out.close(mvhd);
+
+        size_t trak = out.open("trak");
+        size_t tkhd = out.open("tkhd", 0, 3);
+        out.u32(0); out.u32(0); out.u32(1); out.u32(0); out.u32(0);
+        out.zeros(8); out.u16(0); out.u16(0); out.u16(0); out.u16(0);
+        for (uint32_t value : matrix) out.u32(value);
+        out.u32(info.m_width << 16); out.u32(info.m_height << 16);
+        out.close(tkhd);
+
+        size_t mdia = out.open("mdia");
+        size_t mdhd = out.open("mdhd", 0, 0);
+        out.u32(0); out.u32(0); out.u32(TIMESCALE); out.u32(0);
+        out.u16(0x55C4); out.u16(0);           // und
+        out.close(mdhd);
+        size_t hdlr = out.open("hdlr", 0, 0);
+        out.u32(0); out.bytes("vide"); out.zeros(12);
+        out.bytes(std::string("VideoHandler", 13));
+        out.close(hdlr);
+
+        size_t minf = out.open("minf");
+        size_t vmhd = out.open("vmhd", 0, 1);
+        out.zeros(8);
+        out.close(vmhd);
+        size_t dinf = out.open("dinf");
+        size_t dref = out.open("dref", 0, 0);
+        out.u32(1);
+        size_t url = out.open("url ", 0, 1);
+        out.close(url);
+        out.close(dref);
+        out.close(dinf);
+
+        size_t stbl = out.open("stbl");
+        size_t stsd = out.open("stsd", 0, 0);
+        out.u32(1);
+        size_t entry = out.open(m_h265 ? "hev1" : "avc1");
+        out.zeros(6); out.u16(1);
+        out.zeros(16);
+        out.u16(info.m_width); out.u16(info.m_height);
+        out.u32(0x00480000); out.u32(0x00480000); out.u32(0);
+        out.u16(1); out.zeros(32);
+        out.u16(0x0018); out.u16(0xFFFF);
+        if (m_h265) {
+            this->writeHvcC(out, info);
+        } else {
+            this->writeAvcC(out);
+        }
+        out.close(entry);
+        out.close(stsd);
+        for (const char* type : { "stts", "stsc", "stco" }) {
+            size_t empty = out.open(type, 0, 0);
+            out.u32(0);
+            out.close(empty);
+        }
+        size_t stsz = out.open("stsz", 0, 0);
+        out.u32(0); out.u32(0);
+        out.close(stsz);
+        out.close(stbl);
+        out.close(minf);
+        out.close(mdia);
+        out.close(trak);
+
+        size_t mvex = out.open("mvex");
+        size_t trex = out.open("trex", 0, 0);
+        out.u32(1); out.u32(1); out.u32(0); out.u32(0); out.u32(0);
+        out.close(trex);
+        out.close(mvex);
+        out.close(moov);
+
+        m_init = std::make_shared<const std::string>(out.str());
+    }
+
+private:
+    const bool                           m_h265;
+    FramePool&                           m_pool;
+    std::string                          m_vps;
+    std::string                          m_sps;
+    std::string                          m_pps;
+    std::shared_ptr<const std::string>   m_init;
+    uint32_t                             m_sequence;
+    uint64_t                             m_firstTs;
+    uint64_t                             m_lastTs;
+    uint32_t                             m_duration;
+};
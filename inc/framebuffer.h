@@ -0,0 +1,278 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <json/json.h>
+
+#include "framing.h"
+
+class FramePool;
+
+// bytes reserved in front of each frame to prepend a header without moving the payload
+constexpr size_t FRAME_HEADROOM = 64;
+// bytes reserved for the JSON metadata of each frame
+constexpr size_t FRAME_META_SIZE = 256;
+
+/*
+ * A media frame filled once by a CodecHandler, then shared read-only by every subscriber
+ * once it has been published.
+ */
+class Frame {
+    friend class FramePool;
+
+public:
+    enum Flags {
+        KEYFRAME   = 1,   // decodable without any previous frame
+        DISPOSABLE = 2,   // not used as reference, can be dropped
+        BATCH      = 4    // several audio frames, see framing.h
+    };
+
+    explicit Frame(size_t capacity) : m_buffer(new unsigned char[FRAME_HEADROOM + capacity]), m_capacity(capacity), m_size(0), m_header(0), m_wire(0), m_flags(0), m_ts(0), m_metaSize(0) {}
+
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+    const unsigned char* data() const { return m_buffer.get() + FRAME_HEADROOM; }
+    size_t size() const { return m_size; }
+
+    // header written in the headroom followed by the payload
+    const unsigned char* framed() const { return data() - m_header; }
+    size_t framedSize() const { return m_header + m_size; }
+
+    // websocket binary message of the framed payload, written with a single write ; 0 until the header is set
+    const unsigned char* wire() const { return framed() - m_wire; }
+    size_t wireSize() const { return m_wire ? m_wire + m_header + m_size : 0; }
+    size_t capacity() const { return m_capacity; }
+
+    // websocket messages of the JSON framing, metadata then payload, copied once by the first sender and shared with the others
+    std::shared_ptr<const std::vector<unsigned char>> jsonWire() const {
+        std::shared_ptr<const std::vector<unsigned char>> wire = std::atomic_load(&m_jsonWire);
+        if (!wire) {
+            auto built = std::make_shared<std::vector<unsigned char>>(2 * WS_HEADER_MAX_SIZE + m_metaSize + m_size);
+            unsigned char* ptr = built->data();
+            ptr += writeWebsocketHeader(ptr, WS_OPCODE_TEXT, m_metaSize);
+            ptr = std::copy(m_meta, m_meta + m_metaSize, ptr);
+            ptr += writeWebsocketHeader(ptr, WS_OPCODE_BINARY, m_size);
+            ptr = std::copy(data(), data() + m_size, ptr);
+            built->resize(ptr - built->data());
+            wire = built;
+            std::shared_ptr<const std::vector<unsigned char>> expected;
+            if (!std::atomic_compare_exchange_strong(&m_jsonWire, &expected, wire)) {
+                wire = expected;
+            }
+        }
+        return wire;
+    }
+
+    void setFlags(int flags) { m_flags = flags; }
+    int flags() const { return m_flags; }
+    bool isKeyFrame() const { return m_flags & KEYFRAME; }
+    bool isDisposable() const { return m_flags & DISPOSABLE; }
+
+    void setTimestamp(uint64_t ts) { m_ts = ts; }
+    uint64_t timestamp() const { return m_ts; }
+
+    // JSON metadata : cached prefix, timestamp and suffix, written without allocation
+    bool setMeta(const std::string& prefix, uint64_t ts, const std::string& suffix) {
+        char* end = m_meta + FRAME_META_SIZE;
+        if (prefix.size() + suffix.size() + 20 > FRAME_META_SIZE) {
+            m_metaSize = 0;
+            return false;
+        }
+        char* ptr = std::copy(prefix.begin(), prefix.end(), m_meta);
+        ptr = std::to_chars(ptr, end, ts).ptr;
+        ptr = std::copy(suffix.begin(), suffix.end(), ptr);
+        m_metaSize = ptr - m_meta;
+        return true;
+    }
+    const char* meta() const { return m_meta; }
+    size_t metaSize() const { return m_metaSize; }
+
+    bool append(const unsigned char* buffer, size_t size) {
+        if (m_size + size > m_capacity) {
+            return false;
+        }
+        memcpy(m_buffer.get() + FRAME_HEADROOM + m_size, buffer, size);
+        m_size += size;
+        m_wire = 0;
+        return true;
+    }
+
+    // set once the payload is complete, the websocket header is written in front of it
+    bool setHeader(const unsigned char* header, size_t size) {
+        if (size + WS_HEADER_MAX_SIZE > FRAME_HEADROOM) {
+            return false;
+        }
+        if (size) {
+            memcpy(m_buffer.get() + FRAME_HEADROOM - size, header, size);
+        }
+        m_header = size;
+        unsigned char wire[WS_HEADER_MAX_SIZE];
+        m_wire = writeWebsocketHeader(wire, WS_OPCODE_BINARY, m_header + m_size);
+        memcpy(m_buffer.get() + FRAME_HEADROOM - m_header - m_wire, wire, m_wire);
+        return true;
+    }
+
+    bool append(const std::string& buffer) {
+        return append(reinterpret_cast<const unsigned char*>(buffer.data()), buffer.size());
+    }
+
+    // grow the payload by size bytes and return where to write them, nullptr when the capacity is exceeded
+    unsigned char* extend(size_t size) {
+        if (m_size + size > m_capacity) {
+            return nullptr;
+        }
+        unsigned char* ptr = m_buffer.get() + FRAME_HEADROOM + m_size;
+        m_size += size;
+        m_wire = 0;
+        return ptr;
+    }
+
+private:
+    std::unique_ptr<unsigned char[]>  m_buffer;
+    size_t                            m_capacity;
+    size_t                            m_size;
+    size_t                            m_header;
+    size_t                            m_wire;
+    int                               m_flags;
+    uint64_t                          m_ts;
+    char                              m_meta[FRAME_META_SIZE];
+    size_t                            m_metaSize;
+    mutable std::shared_ptr<const std::vector<unsigned char>> m_jsonWire;
+};
+
+using FramePtr = std::shared_ptr<const Frame>;
+
+/*
+ * Recycles frame buffers by power-of-two size class.
+ * Each class keeps as many free buffers as the peak number of frames observed in flight,
+ * so the pool settles on the working set of the stream without reallocating.
+ */
+class FramePool {
+    static constexpr size_t MIN_CLASS_SHIFT = 12;
+    static constexpr size_t NB_CLASSES = 15;
+    static constexpr size_t MAX_FREE_PER_CLASS = 64;
+
+    struct SizeClass {
+        std::vector<std::unique_ptr<Frame>> m_free;
+        size_t                              m_inflight = 0;
+        size_t                              m_peak = 0;
+    };
+
+    struct Slab {
+        std::mutex             m_mutex;
+        SizeClass              m_classes[NB_CLASSES];
+        unsigned long long     m_allocations = 0;
+        unsigned long long     m_reuses = 0;
+        size_t                 m_maxFrameSize = 0;
+
+        void release(Frame* frame, size_t idx) {
+            std::unique_ptr<Frame> owned(frame);
+            if (idx < NB_CLASSES) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                SizeClass& sizeClass = m_classes[idx];
+                sizeClass.m_inflight--;
+                if (sizeClass.m_free.size() < std::min(sizeClass.m_peak, MAX_FREE_PER_CLASS)) {
+                    owned->m_size = 0;
+                    owned->m_header = 0;
+                    owned->m_wire = 0;
+                    owned->m_flags = 0;
+                    owned->m_metaSize = 0;
+                    owned->m_jsonWire.reset();
+                    sizeClass.m_free.push_back(std::move(owned));
+                }
+            }
+        }
+    };
+
+public:
+    FramePool() : m_slab(std::make_shared<Slab>()) {}
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    std::shared_ptr<Frame> acquire(size_t size) {
+        size_t idx = classIndex(size);
+        std::unique_ptr<Frame> frame;
+        {
+            std::lock_guard<std::mutex> lock(m_slab->m_mutex);
+            if (size > m_slab->m_maxFrameSize) {
+                m_slab->m_maxFrameSize = size;
+            }
+            if (idx < NB_CLASSES) {
+                SizeClass& sizeClass = m_slab->m_classes[idx];
+                if (!sizeClass.m_free.empty()) {
+                    frame = std::move(sizeClass.m_free.back());
+                    sizeClass.m_free.pop_back();
+                    m_slab->m_reuses++;
+                }
+                sizeClass.m_inflight++;
+                sizeClass.m_peak = std::max(sizeClass.m_peak, sizeClass.m_inflight);
+            }
+            if (!frame) {
+                m_slab->m_allocations++;
+            }
+        }
+        if (!frame) {
+            frame = std::make_unique<Frame>(idx < NB_CLASSES ? (size_t(1) << (idx + MIN_CLASS_SHIFT)) : size);
+        }
+
+        std::weak_ptr<Slab> slab(m_slab);
+        return std::shared_ptr<Frame>(frame.release(), [slab, idx](Frame* frame) {
+            if (auto owner = slab.lock()) {
+                owner->release(frame, idx);
+            } else {
+                delete frame;
+            }
+        });
+    }
+
+    Json::Value toJSON() const {
+        Json::Value json;
+        std::lock_guard<std::mutex> lock(m_slab->m_mutex);
+        size_t cached = 0;
+        size_t inflight = 0;
+        for (size_t idx = 0; idx < NB_CLASSES; ++idx) {
+            cached += m_slab->m_classes[idx].m_free.size() << (idx + MIN_CLASS_SHIFT);
+            inflight += m_slab->m_classes[idx].m_inflight;
+        }
+        json["allocations"] = Json::Value::UInt64(m_slab->m_allocations);
+        json["reuses"] = Json::Value::UInt64(m_slab->m_reuses);
+        json["maxFrameSize"] = Json::Value::UInt64(m_slab->m_maxFrameSize);
+        json["inflight"] = Json::Value::UInt64(inflight);
+        json["cachedBytes"] = Json::Value::UInt64(cached);
+        return json;
+    }
+
+private:
+    static size_t classIndex(size_t size) {
+        size_t idx = 0;
+        while (idx < NB_CLASSES && (size_t(1) << (idx + MIN_CLASS_SHIFT)) < size) {
+            ++idx;
+        }
+        return idx;
+    }
+
+private:
+    std::shared_ptr<Slab> m_slab;
+};
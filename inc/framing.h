@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * Binary framing of the websocket messages, selected with ?framing=binary on the websocket url.
+ *
+ * Each frame is one binary message : a 16 bytes little-endian header followed by the payload
+ *   offset  size  field
+ *   0       1     version (1)
+ *   1       1     track id
+ *   2       1     flags (1:keyframe, 2:disposable, 4:batch)
+ *   3       1     codec id
+ *   4       4     reserved (0)
+ *   8       8     timestamp in microseconds
+ *
+ * The codec id refers to a descriptor sent as a JSON text message before the first frame using it :
+ *   {"codecid":0, "track":0, "media":"video", "codec":"avc1.42c01e"}
+ *
+ * When the stream has an audio window, the audio frames of a window are sent as one message with the batch flag,
+ * the timestamp of the first frame and a payload made of entries :
+ *   offset  size  field
+ *   0       8     timestamp in microseconds
+ *   8       4     size of the frame
+ *   12      size  frame
+ * Batches are sent only to the binary framing viewers, the JSON viewers receive the audio frames one by one.
+ *
+ * With ?framing=fmp4 the video track is sent as fragmented MP4 for Media Source Extensions :
+ * the descriptor as a JSON text message, then the init segment and one moof+mdat fragment per picture
+ * as binary messages. A new init segment follows a descriptor change. Audio is not sent.
+ */
+enum class Framing { JSON, BINARY, FMP4 };
+
+constexpr uint8_t WS_FRAMING_VERSION = 1;
+constexpr size_t  WS_FRAMING_HEADER_SIZE = 16;
+constexpr size_t  WS_BATCH_ENTRY_HEADER_SIZE = 12;
+constexpr size_t  WS_HEADER_MAX_SIZE = 10;
+constexpr uint8_t WS_OPCODE_TEXT = 1;
+constexpr uint8_t WS_OPCODE_BINARY = 2;
+
+inline Framing parseFraming(const std::string & framing, Framing defaultFraming = Framing::JSON) {
+    if (framing == "binary") {
+        return Framing::BINARY;
+    } else if (framing == "fmp4") {
+        return Framing::FMP4;
+    } else if (framing == "json") {
+        return Framing::JSON;
+    }
+    return defaultFraming;
+}
+
+// framing of a websocket connection from its query string, defaulting to the framing of its url
+inline Framing parseFraming(const char* query, Framing defaultFraming) {
+    const char* framing = query ? strstr(query, "framing=") : nullptr;
+    if (framing) {
+        framing += strlen("framing=");
+        return parseFraming(std::string(framing, strcspn(framing, "&")), defaultFraming);
+    }
+    return defaultFraming;
+}
+
+inline const char* framingName(Framing framing) {
+    switch (framing) {
+        case Framing::BINARY: return "binary";
+        case Framing::FMP4:   return "fmp4";
+        default:              return "json";
+    }
+}
+
+inline void writeFramingHeader(unsigned char* header, uint8_t track, uint8_t flags, uint8_t codecid, uint64_t ts) {
+    header[0] = WS_FRAMING_VERSION;
+    header[1] = track;
+    header[2] = flags;
+    header[3] = codecid;
+    memset(header + 4, 0, 4);
+    for (int i = 0; i < 8; ++i) {
+        header[8 + i] = static_cast<unsigned char>(ts >> (8 * i));
+    }
+}
+
+// header of an unmasked websocket frame as sent by a server, returns its size
+inline size_t writeWebsocketHeader(unsigned char* header, uint8_t opcode, uint64_t size) {
+    header[0] = 0x80 | opcode;
+    if (size < 126) {
+        header[1] = static_cast<unsigned char>(size);
+        return 2;
+    } else if (size <= 0xffff) {
+        header[1] = 126;
+        header[2] = static_cast<unsigned char>(size >> 8);
+        header[3] = static_cast<unsigned char>(size);
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+        header[2 + i] = static_cast<unsigned char>(size >> (8 * (7 - i)));
+    }
+    return WS_HEADER_MAX_SIZE;
+}
+
+inline void writeBatchEntryHeader(unsigned char* header, uint64_t ts, uint32_t size) {
+    for (int i = 0; i < 8; ++i) {
+        header[i] = static_cast<unsigned char>(ts >> (8 * i));
+    }
+    for (int i = 0; i < 4; ++i) {
+        header[8 + i] = static_cast<unsigned char>(size >> (8 * i));
+    }
+}
+
+// frames of a batch payload, the callback gets the timestamp, data and size of each frame
+template <typename Callback>
+inline bool readBatch(const unsigned char* payload, size_t size, Callback callback) {
+    while (size >= WS_BATCH_ENTRY_HEADER_SIZE) {
+        uint64_t ts = 0;
+        for (int i = 7; i >= 0; --i) {
+            ts = (ts << 8) | payload[i];
+        }
+        uint32_t length = 0;
+        for (int i = 3; i >= 0; --i) {
+            length = (length << 8) | payload[8 + i];
+        }
+        payload += WS_BATCH_ENTRY_HEADER_SIZE;
+        size -= WS_BATCH_ENTRY_HEADER_SIZE;
+        if (length > size) {
+            return false;
+        }
+        callback(ts, payload, length);
+        payload += length;
+        size -= length;
+    }
+    return size == 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <json/json.h>
+
+#include "wssubscriber.h"
+
+/*
+ * Video messages since the last keyframe, replayed to a joining viewer before it switches to live.
+ * When the GOP does not fit in the bounds, only the keyframe is kept and the viewer resynchronizes
+ * on the next keyframe after having displayed it.
+ */
+class GopCache {
+public:
+    GopCache(size_t maxFrames, size_t maxBytes) : m_maxFrames(maxFrames), m_maxBytes(maxBytes), m_bytes(0), m_truncated(false) {}
+
+    void add(const WsMessage & msg) {
+        if (!msg.m_video || m_maxFrames == 0) {
+            return;
+        }
+        if (msg.m_frame->isKeyFrame()) {
+            this->clear();
+            if (msg.m_frame->size() > m_maxBytes) {
+                return;
+            }
+        } else if (m_messages.empty() || m_truncated) {
+            return;
+        } else if ( (m_messages.size() >= m_maxFrames) || (m_bytes + msg.m_frame->size() > m_maxBytes) ) {
+            m_messages.resize(1);
+            m_bytes = m_messages.front().m_frame->size();
+            m_truncated = true;
+            return;
+        }
+        m_messages.push_back(msg);
+        m_bytes += msg.m_frame->size();
+    }
+
+    void clear() {
+        m_messages.clear();
+        m_bytes = 0;
+        m_truncated = false;
+    }
+
+    const std::vector<WsMessage>& messages() const { return m_messages; }
+    bool truncated() const { return m_truncated; }
+
+    Json::Value toJSON() const {
+        Json::Value json;
+        json["frames"] = Json::Value::UInt64(m_messages.size());
+        json["bytes"] = Json::Value::UInt64(m_bytes);
+        json["maxFrames"] = Json::Value::UInt64(m_maxFrames);
+        json["maxBytes"] = Json::Value::UInt64(m_maxBytes);
+        json["truncated"] = m_truncated;
+        return json;
+    }
+
+private:
+    const size_t            m_maxFrames;
+    const size_t            m_maxBytes;
+    std::vector<WsMessage>  m_messages;
+    size_t                  m_bytes;
+    bool                    m_truncated;
+};
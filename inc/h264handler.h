@@ -22,34 +22,30 @@ constexpr int H264_PPS=8;
 
 class H264Handler : public H26xHandler {
 public:
-    H264Handler(const SessionParams& params) : H26xHandler(params) {}
+    H264Handler(const SessionParams& params, FramePool& pool) : H26xHandler(params, pool, "avc1") {}
     
-    std::tuple<Json::Value,std::string> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) override {
-        std::string buf(buffer, buffer + size);
+    std::shared_ptr<Frame> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) override {
         int nalu = buffer[4] & 0x1F;
         if (nalu == H264_SPS) {
-            m_sps = buf;
+            m_sps.assign(buffer, buffer + size);
+            m_paramSets = m_sps + m_pps;
+            this->setCodec(codecString(m_sps));
         } else if (nalu == H264_PPS) {
-            m_pps = buf;
-        } else if (nalu == H264_IDR) {
-            buf.insert(0, m_pps);
-            buf.insert(0, m_sps);
+            m_pps.assign(buffer, buffer + size);
+            m_paramSets = m_sps + m_pps;
         }
         if (nalu == H264_IDR || nalu == H264_SLICE) {
-            Json::Value data;
-            data["ts"] = Json::Value::UInt64(1000ULL * 1000 * presentationTime.tv_sec + presentationTime.tv_usec);
-            std::stringstream ss;
-            for (int i = 5; (i < 8) && (i < m_sps.size()); i++) {
-                ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(m_sps[i]);
-            }
-            data["media"] = m_params.m_media;
-            data["codec"] = "avc1." + ss.str();
+            int flags = 0;
             if (nalu == H264_IDR) {
-                data["type"] = "keyframe";
+                flags = Frame::KEYFRAME;
+            } else if ((buffer[4] & 0x60) == 0) {
+                flags = Frame::DISPOSABLE;
             }
-            return std::make_tuple(data, buf);
+            // first_mb_in_slice is ue(v), its first bit is set when it is 0
+            bool firstSlice = (size > 5) && (buffer[5] & 0x80);
+            return this->onSlice(buffer, size, presentationTime, firstSlice, flags, m_paramSets);
         } else {
-            return std::make_tuple(Json::Value(), "");
+            return this->flush();
         }
     }
 
@@ -64,9 +60,24 @@ public:
         return true;
     }
 
+private:
+    // avc1.PPCCLL from profile_idc, constraint flags and level_idc (ISO/IEC 14496-15)
+    static std::string codecString(const std::string& sps) {
+        static const char hex[] = "0123456789abcdef";
+        std::string profile = rbsp(sps, 4);
+        std::string codec("avc1.");
+        for (size_t i = 1; i < profile.size(); i++) {
+            unsigned char byte = profile[i];
+            codec.push_back(hex[byte >> 4]);
+            codec.push_back(hex[byte & 0xF]);
+        }
+        return codec;
+    }
+
 private:
     std::string m_sps;
     std::string m_pps;
+    std::string m_paramSets;    // SPS+PPS copied in front of each IDR, rebuilt only when they change
 };
 
 
@@ -16,43 +16,49 @@
 #include "h26xhandler.h"
 
 
+constexpr int H265_TRAIL_N=0;
 constexpr int H265_SLICE=1;
+constexpr int H265_RSV_VCL_N14=14;
 constexpr int H265_VPS=32;
 constexpr int H265_SPS=33;
 constexpr int H265_PPS=34;
 constexpr int H265_IDR_W_RADL=19;
 constexpr int H265_IDR_N_LP=20;
+constexpr int H265_VCL_MAX=31;
 
 
 class H265Handler : public H26xHandler {
 public:
-    H265Handler(const SessionParams& params) : H26xHandler(params) {}
+    H265Handler(const SessionParams& params, FramePool& pool) : H26xHandler(params, pool, "hev1.1.6.L93.B0") {}
 
-    std::tuple<Json::Value,std::string> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) override {
-        std::string buf(buffer, buffer + size);
+    std::shared_ptr<Frame> onData(unsigned char* buffer, ssize_t size, struct timeval presentationTime) override {
         int nalu = (buffer[4] & 0x7E) >> 1;
         if (nalu == H265_VPS) {
-            m_vps = buf;
+            m_vps.assign(buffer, buffer + size);
+            if (m_sps.empty()) {
+                this->setCodec(codecString(rbsp(m_vps, VPS_PTL_OFFSET + PTL_SIZE), VPS_PTL_OFFSET));
+            }
         } else if (nalu == H265_SPS) {
-            m_sps = buf;
+            m_sps.assign(buffer, buffer + size);
+            this->setCodec(codecString(rbsp(m_sps, SPS_PTL_OFFSET + PTL_SIZE), SPS_PTL_OFFSET));
         } else if (nalu == H265_PPS) {
-            m_pps = buf;
-        } else if (nalu == H265_IDR_W_RADL || nalu == H265_IDR_N_LP) {
-            buf.insert(0, m_pps);
-            buf.insert(0, m_sps);
-            buf.insert(0, m_vps);
+            m_pps.assign(buffer, buffer + size);
+        }
+        if (nalu == H265_VPS || nalu == H265_SPS || nalu == H265_PPS) {
+            m_paramSets = m_vps + m_sps + m_pps;
         }
-        if (nalu == H265_IDR_W_RADL || nalu == H265_IDR_N_LP || nalu == H265_SLICE) {
-            Json::Value data;
-            data["media"] = m_params.m_media;
-            data["codec"] = "hev1.1.6.L93.B0";
-            data["ts"] = Json::Value::UInt64(1000ULL * 1000 * presentationTime.tv_sec + presentationTime.tv_usec);
+        if (nalu <= H265_VCL_MAX) {
+            int flags = 0;
             if (nalu == H265_IDR_W_RADL || nalu == H265_IDR_N_LP) {
-                data["type"] = "keyframe";
+                flags = Frame::KEYFRAME;
+            } else if (nalu <= H265_RSV_VCL_N14 && (nalu % 2) == 0) {
+                // sub-layer non-reference picture : TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N
+                flags = Frame::DISPOSABLE;
             }
-            return std::make_tuple(data, buf);
+            bool firstSlice = (size > 6) && (buffer[6] & 0x80);
+            return this->onSlice(buffer, size, presentationTime, firstSlice, flags, m_paramSets);
         } else {
-            return std::make_tuple(Json::Value(), "");
+            return this->flush();
         }
     }
 
@@ -72,8 +78,51 @@ public:
         return true;
     }
 
+private:
+    // offset of profile_tier_level in the RBSP including the 2 bytes NAL header
+    static constexpr size_t VPS_PTL_OFFSET = 6;
+    static constexpr size_t SPS_PTL_OFFSET = 3;
+    static constexpr size_t PTL_SIZE = 12;
+
+    // hev1.[space]profile.compatibility.tierlevel.constraints from general profile_tier_level (ISO/IEC 14496-15 E.3)
+    std::string codecString(const std::string& rbsp, size_t offset) {
+        if (rbsp.size() < offset + PTL_SIZE) {
+            return this->codec();
+        }
+        const unsigned char* ptl = reinterpret_cast<const unsigned char*>(rbsp.data()) + offset;
+        static const char* spaces[] = { "", "A", "B", "C" };
+        char buf[16];
+
+        std::string codec("hev1.");
+        codec += spaces[ptl[0] >> 6];
+        codec += std::to_string(ptl[0] & 0x1F);
+
+        uint32_t compatibility = 0;
+        for (int i = 0; i < 32; ++i) {
+            if (ptl[1 + i / 8] & (0x80 >> (i % 8))) {
+                compatibility |= (1U << i);
+            }
+        }
+        snprintf(buf, sizeof(buf), ".%X", compatibility);
+        codec += buf;
+
+        codec += (ptl[0] & 0x20) ? ".H" : ".L";
+        codec += std::to_string(ptl[11]);
+
+        int last = 10;
+        while (last >= 5 && ptl[last] == 0) {
+            last--;
+        }
+        for (int i = 5; i <= last; ++i) {
+            snprintf(buf, sizeof(buf), ".%X", ptl[i]);
+            codec += buf;
+        }
+        return codec;
+    }
+
 private:
     std::string m_vps;
     std::string m_sps;
     std::string m_pps;
-};
\ No newline at end of file
+    std::string m_paramSets;    // VPS+SPS+PPS copied in front of each IDR, rebuilt only when they change
+};
@@ -12,17 +12,114 @@
 
 #pragma once
 
+#include <algorithm>
 #include <string>
 
 #include "Base64.hh"
 
 #include "codechandler.h"
 
+/*
+ * live555 delivers one NAL unit at a time, slices of a picture are aggregated in one access unit
+ * so that a picture is published as a single message.
+ * The RTP marker bit is not reported by the session sink, so a picture ends when :
+ *  - a slice of another picture arrives (other presentation time, first_mb_in_slice == 0 or first_slice_segment_in_pic_flag),
+ *  - a non-VCL NAL unit arrives (parameter sets, SEI, AUD start a new access unit),
+ *  - it holds as many slices as the previous pictures, so a stream with a steady slice count is published without delay.
+ */
 class H26xHandler: public CodecHandler {
+    // pictures with less slices than expected before the expectation is lowered
+    static constexpr unsigned int SLICES_DECREASE_COUNT = 8;
+
 public:
-    H26xHandler(const SessionParams& params) : CodecHandler(params) {}
+    H26xHandler(const SessionParams& params, FramePool& pool, const std::string& codec) 
+        : CodecHandler(params, pool, codec), m_auFlags(0), m_auSlices(0), m_lastSlices(0), m_expectedSlices{1,1}, m_lowerSlices{0,0}, m_sizeHint{0,0} {
+        m_auTs = timeval();
+        m_lastTs = timeval();
+    }
 
 protected:
+    // add a slice to the current access unit, return the access unit when it is complete
+    std::shared_ptr<Frame> onSlice(unsigned char* buffer, ssize_t size, struct timeval presentationTime, bool firstSlice, int flags, const std::string& paramSets) {
+        std::shared_ptr<Frame> done;
+        if (m_au && (firstSlice || !sameTime(presentationTime, m_auTs))) {
+            done = this->flush();
+        }
+
+        if (!m_au) {
+            if (!firstSlice && sameTime(presentationTime, m_lastTs)) {
+                // continuation of a picture already published, expect more slices next time
+                m_auSlices = m_lastSlices;
+            } else {
+                m_auSlices = 0;
+            }
+            int type = (flags & Frame::KEYFRAME) ? 1 : 0;
+            size_t prefix = (flags & Frame::KEYFRAME) ? paramSets.size() : 0;
+            size_t hint = (m_expectedSlices[type] > 1) ? std::max(m_sizeHint[type], prefix + size * m_expectedSlices[type]) : prefix + size;
+            m_au = m_pool.acquire(hint);
+            if (flags & Frame::KEYFRAME) {
+                m_au->append(paramSets);
+            }
+            m_auTs = presentationTime;
+            m_auFlags = flags;
+        } else {
+            m_auFlags = (m_auFlags | (flags & Frame::KEYFRAME)) & (flags | ~Frame::DISPOSABLE);
+        }
+
+        if (!m_au->append(buffer, size)) {
+            std::shared_ptr<Frame> bigger = m_pool.acquire(2 * (m_au->size() + size));
+            bigger->append(m_au->data(), m_au->size());
+            bigger->append(buffer, size);
+            m_au = bigger;
+        }
+        m_auSlices++;
+
+        if (!done && (m_auSlices >= m_expectedSlices[(m_auFlags & Frame::KEYFRAME) ? 1 : 0])) {
+            done = this->flush();
+        }
+        return done;
+    }
+
+    // publish the pending access unit
+    std::shared_ptr<Frame> flush() {
+        if (!m_au) {
+            return nullptr;
+        }
+        int type = (m_auFlags & Frame::KEYFRAME) ? 1 : 0;
+        if (m_auSlices > m_expectedSlices[type]) {
+            m_expectedSlices[type] = m_auSlices;
+            m_lowerSlices[type] = 0;
+        } else if (m_auSlices < m_expectedSlices[type] && ++m_lowerSlices[type] >= SLICES_DECREASE_COUNT) {
+            m_expectedSlices[type] = m_auSlices;
+            m_lowerSlices[type] = 0;
+        }
+        m_sizeHint[type] = m_au->size() + m_au->size() / 4;
+        m_lastTs = m_auTs;
+        m_lastSlices = m_auSlices;
+
+        this->stamp(*m_au, m_auTs, m_auFlags);
+        return std::move(m_au);
+    }
+
+    static bool sameTime(const struct timeval& a, const struct timeval& b) {
+        return (a.tv_sec == b.tv_sec) && (a.tv_usec == b.tv_usec);
+    }
+
+    // NAL unit without start code and emulation prevention bytes
+    static std::string rbsp(const std::string& nal, size_t maxSize) {
+        std::string out;
+        size_t zeros = 0;
+        for (size_t i = sizeof(H26X_marker); (i < nal.size()) && (out.size() < maxSize); ++i) {
+            unsigned char byte = nal[i];
+            if ((zeros >= 2) && (byte == 3)) {
+                zeros = 0;
+                continue;
+            }
+            zeros = (byte == 0) ? zeros + 1 : 0;
+            out.push_back(byte);
+        }
+        return out;
+    }
 
     void onCfg(const std::string& prop) {
         unsigned int length = 0;
@@ -36,6 +133,18 @@ protected:
         }
     }
 
+private:
+    std::shared_ptr<Frame>  m_au;
+    struct timeval          m_auTs;
+    int                     m_auFlags;
+    unsigned int            m_auSlices;
+    struct timeval          m_lastTs;
+    unsigned int            m_lastSlices;
+    // indexed by keyframe
+    unsigned int            m_expectedSlices[2];
+    unsigned int            m_lowerSlices[2];
+    size_t                  m_sizeHint[2];
+
 };
 
 
@@ -0,0 +1,133 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "CivetServer.h"
+#include "segmentring.h"
+
+/*
+ * LL-HLS of a stream under /hls/<name>/ : index.m3u8 (with _HLS_msn/_HLS_part blocking reload),
+ * init.mp4?id=, segment.m4s?msn= and part.m4s?msn=&part= (blocking on the preload hint).
+ * Every request is served from the segment ring by the civetweb worker.
+ */
+class HlsHandler : public CivetHandler {
+public:
+    HlsHandler(SegmentRing & ring, std::function<void()> keepAlive) : m_ring(ring), m_keepAlive(keepAlive) {}
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override {
+        m_keepAlive();
+        const struct mg_request_info *req_info = mg_get_request_info(conn);
+        std::string uri(req_info->local_uri);
+        std::string file = uri.substr(uri.find_last_of('/') + 1);
+        const char* query = req_info->query_string;
+
+        if (file == "index.m3u8") {
+            std::string playlist;
+            int status = m_ring.playlist(queryValue(query, "_HLS_msn"), queryValue(query, "_HLS_part"), m_ring.blockTimeout(), playlist);
+            if (status == 400) {
+                mg_send_http_error(conn, 400, "%s", "_HLS_msn is too far ahead");
+                return true;
+            } else if (status != 200) {
+                mg_send_http_error(conn, 503, "%s", "playlist not available");
+                return true;
+            }
+            mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: application/vnd.apple.mpegurl\r\nCache-Control: no-cache\r\nContent-Length: %zu\r\n\r\n", playlist.size());
+            mg_write(conn, playlist.c_str(), playlist.size());
+        } else if (file == "init.mp4") {
+            std::shared_ptr<const std::string> init = m_ring.init(queryValue(query, "id"));
+            if (!init) {
+                mg_send_http_error(conn, 404, "%s", "unknown init segment");
+                return true;
+            }
+            mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: video/mp4\r\nContent-Length: %zu\r\n\r\n", init->size());
+            mg_write(conn, init->data(), init->size());
+        } else if (file == "segment.m4s" || file == "part.m4s") {
+            long long part = (file == "part.m4s") ? queryValue(query, "part") : -1;
+            std::vector<FramePtr> fragments;
+            if ((file == "part.m4s" && part < 0) || !m_ring.fragments(queryValue(query, "msn"), part, m_ring.blockTimeout(), fragments)) {
+                mg_send_http_error(conn, 404, "%s", "segment not available");
+                return true;
+            }
+            size_t size = 0;
+            for (const auto & fragment : fragments) {
+                size += fragment->size();
+            }
+            mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: video/mp4\r\nCache-Control: max-age=60\r\nContent-Length: %zu\r\n\r\n", size);
+            for (const auto & fragment : fragments) {
+                mg_write(conn, fragment->data(), fragment->size());
+            }
+        } else {
+            mg_send_http_error(conn, 404, "%s", "not found");
+        }
+        return true;
+    }
+
+private:
+    static long long queryValue(const char* query, const char* name) {
+        char value[32];
+        if (query && mg_get_var(query, strlen(query), name, value, sizeof(value)) > 0) {
+            return atoll(value);
+        }
+        return -1;
+    }
+
+private:
+    SegmentRing &          m_ring;
+    std::function<void()>  m_keepAlive;
+};
+
+/*
+ * Progressive fMP4 of a stream on /fmp4/<name> with chunked transfer encoding,
+ * starting at the last keyframe and following the live edge.
+ */
+class Fmp4StreamHandler : public CivetHandler {
+public:
+    Fmp4StreamHandler(SegmentRing & ring, std::function<void()> keepAlive) : m_ring(ring), m_keepAlive(keepAlive) {}
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override {
+        m_keepAlive();
+        mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: video/mp4\r\nCache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+        std::shared_ptr<const std::string> sent;
+        std::shared_ptr<const std::string> init;
+        uint64_t index = m_ring.liveStart(init);
+        std::vector<FramePtr> fragments;
+        while (m_ring.next(index, std::chrono::seconds(1), fragments, init)) {
+            m_keepAlive();
+            if (init && init != sent) {
+                if (mg_send_chunk(conn, init->data(), init->size()) <= 0) {
+                    return true;
+                }
+                sent = init;
+            }
+            for (const auto & fragment : fragments) {
+                if (sent && mg_send_chunk(conn, reinterpret_cast<const char*>(fragment->data()), fragment->size()) <= 0) {
+                    return true;
+                }
+            }
+            fragments.clear();
+        }
+        mg_send_chunk(conn, "", 0);
+        return true;
+    }
+
+private:
+    SegmentRing &          m_ring;
+    std::function<void()>  m_keepAlive;
+};
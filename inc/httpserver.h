@@ -12,15 +12,24 @@
 
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <map>
 #include <thread>
 #include <cstdio>
 #include <memory>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 #include "HttpServerRequestHandler.h"
+#include "eventloop.h"
+#include "metrics.h"
 #include "wsstream.h"
+#include "snapshot.h"
+#include "tracer.h"
+#include "egress.h"
 
 inline int logger(const struct mg_connection *conn, const char *message) 
 {
@@ -35,30 +44,76 @@ inline int logger(const struct mg_connection *conn, const char *message)
 
 class HttpServer
 {
+        static constexpr size_t SNAPSHOT_THREADS = 2;
+        static constexpr size_t SNAPSHOT_QUEUE = 16;
+
     public:
-        HttpServer(const Json::Value & config, const std::vector<std::string>& options, const std::string & rtptransport, int verbose)
-            : m_httpServer(this->getHttpFunc(), m_wsfunc, options, verbose ? logger : nullptr) {
+        HttpServer(const Json::Value & config, const std::vector<std::string>& options, const std::string & rtptransport, unsigned int nbloops, int verbose)
+            : m_httpServer(this->getHttpFunc(), m_wsfunc, options, verbose ? logger : nullptr), m_loops(nbloops),
+              m_egress(config.get("egress", 0).asDouble() * 1000000),
+              m_metricsHandler([this]() { return this->getMetrics(); }),
+              m_snapshotWorkers(SNAPSHOT_THREADS, SNAPSHOT_QUEUE),
+              m_snapshotHandler("/api/snapshot", [this](const std::string & wsurl, int width, std::chrono::milliseconds timeout) { return this->getSnapshot(wsurl, width, timeout); }) {
                 Json::Value urls(config["urls"]);
                 for (auto & url : urls.getMemberNames()) {
-                    this->addStream("/"+url, urls[url]["video"].asString(), rtptransport, verbose);
+                    this->addStream("/"+url, urls[url], rtptransport, verbose);
                 }
+                m_httpServer.addHandler("/metrics", &m_metricsHandler);
+                m_httpServer.addHandler("/api/snapshot", &m_snapshotHandler);
         }
 
         HttpServer(const HttpServer&) = delete;
         HttpServer& operator=(const HttpServer&) = delete;
-        HttpServer(HttpServer&&) noexcept = default;
-        HttpServer& operator=(HttpServer&&) noexcept = default;
-        ~HttpServer() = default;
+        ~HttpServer() {
+            m_httpServer.removeHandler("/metrics");
+            m_httpServer.removeHandler("/api/snapshot");
+        }
 
         const void* getContext() const { 
             return m_httpServer.getContext(); 
         }
 
     private:
-        void addStream(const std::string & wsurl, const std::string & rtspurl, const std::string & rtptransport, int verbose) {
-            m_streams[wsurl] = std::make_unique<WsStream<RTSPConnection>>(m_httpServer, wsurl, rtspurl, rtptransport, verbose);
+        // websocket urls pulling the same RTSP url with the same transport share one ingest, configured by the first one
+        void addStream(const std::string & wsurl, const Json::Value & config, const std::string & rtptransport, int verbose) {
+            std::string transport = config.get("rtptransport", rtptransport).asString();
+            std::string key = config["video"].asString() + " " + transport;
+            auto it = m_streams.find(key);
+            if (it != m_streams.end()) {
+                it->second->addUrl(wsurl, config);
+            } else {
+                m_streams[key] = std::make_unique<WsStream<RTSPConnection>>(m_httpServer, m_loops, m_egress, wsurl, config, transport, verbose);
+            }
         }
 
+        Snapshot getSnapshot(const std::string & wsurl, int width, std::chrono::milliseconds timeout) {
+            for (auto & it : m_streams) {
+                const std::vector<std::string> & urls = it.second->urls();
+                if (std::find(urls.begin(), urls.end(), wsurl) != urls.end()) {
+                    return it.second->snapshot(width, timeout, m_snapshotWorkers);
+                }
+            }
+            Snapshot snapshot;
+            snapshot.m_status = 404;
+            return snapshot;
+        }
+
+        std::string getMetrics() {
+            PrometheusWriter writer;
+            for (auto & it : m_streams) {
+                it.second->writeMetrics(writer);
+            }
+            m_loops.write(writer);
+            m_egress.write(writer);
+#ifndef _WIN32
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) == 0) {
+                writer.counter("rtsp2ws_process_cpu_seconds_total", "CPU time of the process", "", usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+                writer.gauge("rtsp2ws_process_max_resident_bytes", "Maximum resident set size of the process", "", usage.ru_maxrss * 1024.0);
+            }
+#endif
+            return writer.str();
+        }
 
         std::map<std::string,HttpServerRequestHandler::httpFunction>& getHttpFunc() {
             if (m_httpfunc.empty()) {
@@ -68,10 +123,22 @@ class HttpServer
                 m_httpfunc["/api/streams"] = [this](const struct mg_request_info *, const Json::Value &) -> Json::Value {
                         Json::Value answer(Json::objectValue);
                         for (auto & it : m_streams) {
-                                answer[it.first] = it.second->toJSON();
+                                Json::Value stream = it.second->toJSON();
+                                for (const auto & url : it.second->urls()) {
+                                        answer[url] = stream;
+                                }
                         }
                         return answer;
                 };                
+                m_httpfunc["/api/trace"] = [this](const struct mg_request_info *, const Json::Value &) -> Json::Value {
+                        return Tracer::instance().toJSON();
+                };
+                m_httpfunc["/api/egress"] = [this](const struct mg_request_info *, const Json::Value &) -> Json::Value {
+                        return m_egress.toJSON();
+                };
+                m_httpfunc["/api/loops"] = [this](const struct mg_request_info *, const Json::Value &) -> Json::Value {
+                        return m_loops.toJSON();
+                };
                 m_httpfunc["/api/help"]    = [this](const struct mg_request_info *, const Json::Value & ) -> Json::Value {
                         Json::Value answer(Json::arrayValue);
                     for (const auto & it : m_httpfunc) {
@@ -87,5 +154,10 @@ class HttpServer
         std::map<std::string,HttpServerRequestHandler::httpFunction>      m_httpfunc;
         std::map<std::string,HttpServerRequestHandler::wsFunction>        m_wsfunc;
         HttpServerRequestHandler                                          m_httpServer;
+        EventLoopPool                                                     m_loops;
+        EgressScheduler                                                   m_egress;
+        MetricsHandler                                                    m_metricsHandler;
+        SnapshotWorkers                                                   m_snapshotWorkers;
+        SnapshotHandler                                                   m_snapshotHandler;
         std::map<std::string, std::unique_ptr<WsStream<RTSPConnection>>>  m_streams;
 };
@@ -0,0 +1,299 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "CivetServer.h"
+
+/*
+ * Lock-free metrics : recording is a relaxed atomic increment, readers only take snapshots.
+ */
+class Counter {
+public:
+    Counter() : m_value(0) {}
+
+    void add(uint64_t value = 1) { m_value.fetch_add(value, std::memory_order_relaxed); }
+    uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> m_value;
+};
+
+class Gauge {
+public:
+    Gauge() : m_value(0) {}
+
+    void set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+    void add(int64_t value) { m_value.fetch_add(value, std::memory_order_relaxed); }
+    int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value;
+};
+
+// histogram of durations in microseconds with fixed buckets
+class Histogram {
+public:
+    static constexpr size_t NB_BUCKETS = 12;
+    static constexpr uint64_t BOUNDS[NB_BUCKETS] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 100000 };
+
+    Histogram() : m_sum(0), m_count(0) {
+        for (auto & bucket : m_buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void observe(uint64_t value) {
+        size_t idx = 0;
+        while (idx < NB_BUCKETS && value > BOUNDS[idx]) {
+            ++idx;
+        }
+        m_buckets[idx].fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t bucket(size_t idx) const { return m_buckets[idx].load(std::memory_order_relaxed); }
+
+    // upper bound of the bucket holding the quantile
+    uint64_t quantile(double q) const {
+        uint64_t total = 0;
+        for (size_t idx = 0; idx <= NB_BUCKETS; ++idx) {
+            total += bucket(idx);
+        }
+        uint64_t rank = static_cast<uint64_t>(q * total);
+        uint64_t cumulative = 0;
+        for (size_t idx = 0; idx < NB_BUCKETS; ++idx) {
+            cumulative += bucket(idx);
+            if (cumulative > rank) {
+                return BOUNDS[idx];
+            }
+        }
+        return total ? BOUNDS[NB_BUCKETS - 1] : 0;
+    }
+
+    Json::Value toJSON() const {
+        Json::Value json;
+        json["count"] = Json::Value::UInt64(count());
+        json["avg"] = Json::Value::UInt64(count() ? sum() / count() : 0);
+        json["p50"] = Json::Value::UInt64(quantile(0.5));
+        json["p99"] = Json::Value::UInt64(quantile(0.99));
+        return json;
+    }
+
+private:
+    std::atomic<uint64_t> m_buckets[NB_BUCKETS + 1];
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_count;
+};
+
+/*
+ * Prometheus text exposition, samples are grouped by metric family.
+ */
+class PrometheusWriter {
+public:
+    void counter(const std::string & name, const std::string & help, const std::string & labels, uint64_t value) {
+        this->sample(name, "counter", help, name + "{" + labels + "} " + std::to_string(value));
+    }
+
+    void counter(const std::string & name, const std::string & help, const std::string & labels, double value) {
+        this->sample(name, "counter", help, name + "{" + labels + "} " + std::to_string(value));
+    }
+
+    void gauge(const std::string & name, const std::string & help, const std::string & labels, double value) {
+        this->sample(name, "gauge", help, name + "{" + labels + "} " + std::to_string(value));
+    }
+
+    void histogram(const std::string & name, const std::string & help, const std::string & labels, const Histogram & histogram) {
+        std::string sep = labels.empty() ? "" : ",";
+        uint64_t cumulative = 0;
+        for (size_t idx = 0; idx < Histogram::NB_BUCKETS; ++idx) {
+            cumulative += histogram.bucket(idx);
+            this->sample(name, "histogram", help, name + "_bucket{" + labels + sep + "le=\"" + std::to_string(Histogram::BOUNDS[idx]) + "\"} " + std::to_string(cumulative));
+        }
+        cumulative += histogram.bucket(Histogram::NB_BUCKETS);
+        this->sample(name, "histogram", help, name + "_bucket{" + labels + sep + "le=\"+Inf\"} " + std::to_string(cumulative));
+        this->sample(name, "histogram", help, name + "_sum{" + labels + "} " + std::to_string(histogram.sum()));
+        this->sample(name, "histogram", help, name + "_count{" + labels + "} " + std::to_string(histogram.count()));
+    }
+
+    std::string str() const {
+        std::string out;
+        for (const auto & name : m_order) {
+            const Family & family = m_families.at(name);
+            out += "# HELP " + name + " " + family.m_help + "\n";
+            out += "# TYPE " + name + " " + family.m_type + "\n";
+            for (const auto & line : family.m_samples) {
+                out += line + "\n";
+            }
+        }
+        return out;
+    }
+
+    static std::string label(const std::string & name, const std::string & value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                escaped.push_back('\\');
+            }
+            escaped.push_back(c);
+        }
+        return name + "=\"" + escaped + "\"";
+    }
+
+private:
+    struct Family {
+        std::string               m_type;
+        std::string               m_help;
+        std::vector<std::string>  m_samples;
+    };
+
+    void sample(const std::string & name, const std::string & type, const std::string & help, const std::string & line) {
+        auto it = m_families.find(name);
+        if (it == m_families.end()) {
+            it = m_families.insert(std::make_pair(name, Family{type, help, {}})).first;
+            m_order.push_back(name);
+        }
+        it->second.m_samples.push_back(line);
+    }
+
+private:
+    std::map<std::string, Family>  m_families;
+    std::vector<std::string>       m_order;
+};
+
+// serve the Prometheus text format
+class MetricsHandler : public CivetHandler {
+public:
+    MetricsHandler(std::function<std::string()> collect) : m_collect(collect) {}
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override {
+        std::string body = m_collect();
+        mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+        mg_write(conn, body.c_str(), body.size());
+        return true;
+    }
+
+private:
+    std::function<std::string()> m_collect;
+};
+
+/*
+ * Metrics of a stream, updated from the event loop and the writer threads.
+ */
+class StreamMetrics {
+public:
+    enum Media { VIDEO, AUDIO, NB_MEDIA };
+
+    StreamMetrics() : m_lastTime(std::chrono::steady_clock::now()), m_lastFrames{0,0}, m_lastBytes{0,0}, m_fps{0,0}, m_bitrate{0,0} {}
+
+    Counter     m_frames[NB_MEDIA];
+    Counter     m_bytes[NB_MEDIA];
+    Counter     m_keyframes;
+    Counter     m_drops;
+    Counter     m_sent;
+    Counter     m_sentBytes;
+    Counter     m_writes;
+    Counter     m_sendCpu;      // microseconds
+    Counter     m_rtspErrors;
+    Counter     m_connectionTimeouts;
+    Counter     m_dataTimeouts;
+    Histogram   m_publishLatency;
+
+    static const char* mediaName(int media) { return media == VIDEO ? "video" : "audio"; }
+
+    Json::Value toJSON() {
+        this->updateRates();
+        Json::Value json;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int media = 0; media < NB_MEDIA; ++media) {
+            Json::Value stats;
+            stats["frames"] = Json::Value::UInt64(m_frames[media].value());
+            stats["bytes"] = Json::Value::UInt64(m_bytes[media].value());
+            stats["fps"] = m_fps[media];
+            stats["bitrate"] = m_bitrate[media];
+            json[mediaName(media)] = stats;
+        }
+        json["keyframes"] = Json::Value::UInt64(m_keyframes.value());
+        json["drops"] = Json::Value::UInt64(m_drops.value());
+        json["sent"] = Json::Value::UInt64(m_sent.value());
+        json["sentBytes"] = Json::Value::UInt64(m_sentBytes.value());
+        json["writes"] = Json::Value::UInt64(m_writes.value());
+        json["writesPerFrame"] = m_sent.value() ? double(m_writes.value()) / m_sent.value() : 0.0;
+        json["sendCpuMs"] = Json::Value::UInt64(m_sendCpu.value() / 1000);
+        json["sendCpuUsPerFrame"] = m_sent.value() ? double(m_sendCpu.value()) / m_sent.value() : 0.0;
+        json["rtspErrors"] = Json::Value::UInt64(m_rtspErrors.value());
+        json["connectionTimeouts"] = Json::Value::UInt64(m_connectionTimeouts.value());
+        json["dataTimeouts"] = Json::Value::UInt64(m_dataTimeouts.value());
+        json["publishLatencyUs"] = m_publishLatency.toJSON();
+        return json;
+    }
+
+    void write(PrometheusWriter & writer, const std::string & labels) const {
+        for (int media = 0; media < NB_MEDIA; ++media) {
+            std::string mediaLabels = labels + "," + PrometheusWriter::label("media", mediaName(media));
+            writer.counter("rtsp2ws_frames_total", "Frames received from RTSP", mediaLabels, m_frames[media].value());
+            writer.counter("rtsp2ws_bytes_total", "Bytes received from RTSP", mediaLabels, m_bytes[media].value());
+        }
+        writer.counter("rtsp2ws_keyframes_total", "Keyframes received from RTSP", labels, m_keyframes.value());
+        writer.counter("rtsp2ws_dropped_frames_total", "Frames dropped by slow websocket subscribers", labels, m_drops.value());
+        writer.counter("rtsp2ws_sent_frames_total", "Frames sent to websocket subscribers", labels, m_sent.value());
+        writer.counter("rtsp2ws_sent_bytes_total", "Bytes written to the websocket connections", labels, m_sentBytes.value());
+        writer.counter("rtsp2ws_websocket_writes_total", "Writes to the websocket connections", labels, m_writes.value());
+        writer.counter("rtsp2ws_send_cpu_seconds_total", "CPU time of the websocket senders", labels, m_sendCpu.value() / 1e6);
+        writer.counter("rtsp2ws_rtsp_errors_total", "RTSP errors leading to a reconnection", labels, m_rtspErrors.value());
+        writer.counter("rtsp2ws_rtsp_connection_timeouts_total", "RTSP connection timeouts leading to a reconnection", labels, m_connectionTimeouts.value());
+        writer.counter("rtsp2ws_rtsp_data_timeouts_total", "RTSP data timeouts leading to a reconnection", labels, m_dataTimeouts.value());
+        writer.histogram("rtsp2ws_publish_latency_microseconds", "Time from RTSP data to subscriber queues", labels, m_publishLatency);
+    }
+
+private:
+    // rates computed between two reports, at most once per second
+    void updateRates() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - m_lastTime).count();
+        if (elapsed < 1.0) {
+            return;
+        }
+        for (int media = 0; media < NB_MEDIA; ++media) {
+            uint64_t frames = m_frames[media].value();
+            uint64_t bytes = m_bytes[media].value();
+            m_fps[media] = (frames - m_lastFrames[media]) / elapsed;
+            m_bitrate[media] = (bytes - m_lastBytes[media]) * 8 / elapsed;
+            m_lastFrames[media] = frames;
+            m_lastBytes[media] = bytes;
+        }
+        m_lastTime = now;
+    }
+
+private:
+    std::mutex                              m_mutex;
+    std::chrono::steady_clock::time_point   m_lastTime;
+    uint64_t                                m_lastFrames[NB_MEDIA];
+    uint64_t                                m_lastBytes[NB_MEDIA];
+    double                                  m_fps[NB_MEDIA];
+    double                                  m_bitrate[NB_MEDIA];
+};
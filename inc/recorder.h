@@ -0,0 +1,525 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <json/json.h>
+
+#include "wssubscriber.h"
+
+/*
+ * Recording of a stream in time-indexed segments under <dir>/<name>/, named by the timestamp of their first frame :
+ *  - <start>.r2w : "R2WS" and a 4 bytes version, then records made of a 8 bytes header (size, type, 3 reserved bytes)
+ *                  and the payload : 'D' the JSON codec descriptor of a track, 'F' a frame with its 16 bytes binary framing header
+ *  - <start>.idx : 16 bytes entries, timestamp and offset in the .r2w of the keyframes, written when the segment is closed
+ * All the integers are little-endian.
+ */
+namespace RecordFormat {
+    constexpr char     MAGIC[4] = {'R', '2', 'W', 'S'};
+    constexpr uint32_t FORMAT_VERSION = 1;
+    constexpr size_t   FILE_HEADER_SIZE = 8;
+    constexpr size_t   RECORD_HEADER_SIZE = 8;
+    constexpr size_t   INDEX_ENTRY_SIZE = 16;
+    constexpr uint8_t  DESCRIPTOR = 'D';
+    constexpr uint8_t  FRAME = 'F';
+
+    inline void put32(unsigned char* ptr, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            ptr[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    }
+
+    inline void put64(unsigned char* ptr, uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            ptr[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    }
+
+    inline uint32_t get32(const unsigned char* ptr) {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; --i) {
+            value = (value << 8) | ptr[i];
+        }
+        return value;
+    }
+
+    inline uint64_t get64(const unsigned char* ptr) {
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; --i) {
+            value = (value << 8) | ptr[i];
+        }
+        return value;
+    }
+}
+
+/*
+ * Segment file written by large aligned blocks, opened with O_DIRECT when the filesystem supports it
+ * and preallocated to the expected size of the segment.
+ */
+class SegmentFile {
+public:
+    static constexpr size_t BLOCK_SIZE = 4096;
+
+    SegmentFile() : m_fd(-1), m_direct(false), m_writes(0) {}
+    SegmentFile(const SegmentFile&) = delete;
+    SegmentFile& operator=(const SegmentFile&) = delete;
+    ~SegmentFile() {
+        if (m_fd >= 0) {
+#ifndef _WIN32
+            ::close(m_fd);
+#else
+            fclose(m_file);
+#endif
+        }
+    }
+
+    bool open(const std::string & path, size_t preallocate) {
+#ifndef _WIN32
+#ifdef O_DIRECT
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        m_direct = (m_fd >= 0);
+#endif
+        if (m_fd < 0) {
+            m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (m_fd >= 0 && preallocate) {
+            posix_fallocate(m_fd, 0, preallocate);
+        }
+#else
+        m_file = fopen(path.c_str(), "wb");
+        m_fd = m_file ? 0 : -1;
+#endif
+        return m_fd >= 0;
+    }
+
+    // buffer and size are multiples of BLOCK_SIZE
+    bool write(const unsigned char* buffer, size_t size, uint64_t offset) {
+        m_writes++;
+#ifndef _WIN32
+        while (size > 0) {
+            ssize_t written = pwrite(m_fd, buffer, size, offset);
+            if (written <= 0) {
+                return false;
+            }
+            buffer += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+#else
+        return (_fseeki64(m_file, offset, SEEK_SET) == 0) && (fwrite(buffer, 1, size, m_file) == size);
+#endif
+    }
+
+    // drop the padding of the last block and the preallocated space
+    void close(uint64_t size) {
+        if (m_fd < 0) {
+            return;
+        }
+#ifndef _WIN32
+        if (ftruncate(m_fd, size) != 0) {
+            std::cout << "cannot truncate segment:" << strerror(errno) << std::endl;
+        }
+        ::close(m_fd);
+#else
+        fclose(m_file);
+#endif
+        m_fd = -1;
+    }
+
+    bool isOpen() const { return m_fd >= 0; }
+    bool direct() const { return m_direct; }
+    unsigned long long writes() const { return m_writes; }
+
+private:
+    int                 m_fd;
+#ifdef _WIN32
+    FILE*               m_file;
+#endif
+    bool                m_direct;
+    unsigned long long  m_writes;
+};
+
+/*
+ * Records the published frames of a stream from its own I/O thread.
+ * The ingest only queues the shared frames, when the writer falls behind the queue is bounded
+ * and the video resumes at the next keyframe. Old segments are removed by total size and age.
+ */
+class Recorder {
+    static constexpr size_t BUFFER_SIZE = 1024*1024;
+    static constexpr size_t MAX_QUEUE_BYTES = 64*1024*1024;
+    static constexpr size_t DEFAULT_PREALLOCATE = 16*1024*1024;
+    static constexpr std::chrono::seconds FLUSH_INTERVAL = std::chrono::seconds(1);
+
+public:
+    struct SegmentInfo {
+        uint64_t              m_start;
+        uint64_t              m_bytes;
+        std::filesystem::path m_path;
+    };
+
+    Recorder(const std::string & dir, double segmentDuration, unsigned long long maxBytes, unsigned int maxAge)
+        : m_dir(dir), m_segmentDuration(segmentDuration * 1000000), m_maxBytes(maxBytes), m_maxAge(maxAge),
+          m_queueBytes(0), m_waitKeyFrame(true), m_stop(false), m_drops(0),
+          m_buffer(allocateBuffer()), m_bufferSize(0), m_fileOffset(0), m_fileSize(0), m_segmentStart(0), m_lastIndexTs(0), m_hasVideo(false),
+          m_preallocate(DEFAULT_PREALLOCATE), m_bytes(0), m_writes(0), m_rate(0), m_diskBytes(0), m_direct(false), m_flushed(0) {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        this->scan();
+        m_thread = std::thread([this]() { this->run(); });
+    }
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    ~Recorder() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+
+    // called by the ingest, never blocks on the disk
+    void push(const WsMessage & msg) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (msg.m_video) {
+                if (msg.m_frame->isKeyFrame()) {
+                    m_waitKeyFrame = false;
+                } else if (m_waitKeyFrame) {
+                    m_drops++;
+                    return;
+                }
+            }
+            if (m_queueBytes + msg.m_frame->framedSize() > MAX_QUEUE_BYTES) {
+                m_drops++;
+                m_waitKeyFrame = true;
+                return;
+            }
+            m_queue.push_back(msg);
+            m_queueBytes += msg.m_frame->framedSize();
+        }
+        m_cond.notify_one();
+    }
+
+    // closed segments, oldest first
+    std::vector<SegmentInfo> segments() {
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        return std::vector<SegmentInfo>(m_segments.begin(), m_segments.end());
+    }
+
+    // segment being written with its keyframes index, m_bytes is the part already readable from its file
+    bool current(SegmentInfo & info, std::vector<unsigned char> & index) {
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        if (m_current.empty()) {
+            return false;
+        }
+        info = SegmentInfo{m_segmentStart, m_flushed, m_current};
+        index = m_index;
+        return true;
+    }
+
+    const std::filesystem::path & dir() const { return m_dir; }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        json["dir"] = m_dir.string();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            json["queue"] = Json::Value::UInt64(m_queue.size());
+            json["queueBytes"] = Json::Value::UInt64(m_queueBytes);
+            json["drops"] = Json::Value::UInt64(m_drops);
+        }
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        json["bytes"] = Json::Value::UInt64(m_bytes);
+        json["writes"] = Json::Value::UInt64(m_writes);
+        json["throughput"] = Json::Value::UInt64(m_rate);
+        json["direct"] = m_direct;
+        json["segments"] = Json::Value::UInt64(m_segments.size());
+        json["diskBytes"] = Json::Value::UInt64(m_diskBytes);
+        json["current"] = m_current;
+        return json;
+    }
+
+private:
+    struct AlignedFree {
+        void operator()(unsigned char* ptr) { free(ptr); }
+    };
+
+    static unsigned char* allocateBuffer() {
+#ifndef _WIN32
+        void* ptr = nullptr;
+        return (posix_memalign(&ptr, SegmentFile::BLOCK_SIZE, BUFFER_SIZE) == 0) ? static_cast<unsigned char*>(ptr) : nullptr;
+#else
+        return static_cast<unsigned char*>(malloc(BUFFER_SIZE));
+#endif
+    }
+
+    // segments left by a previous run
+    void scan() {
+        std::error_code ec;
+        for (const auto & entry : std::filesystem::directory_iterator(m_dir, ec)) {
+            if (entry.path().extension() == ".r2w") {
+                SegmentInfo info;
+                info.m_start = strtoull(entry.path().stem().string().c_str(), nullptr, 10);
+                info.m_bytes = entry.file_size(ec);
+                info.m_path = entry.path();
+                m_segments.push_back(info);
+                m_diskBytes += info.m_bytes;
+            }
+        }
+        std::sort(m_segments.begin(), m_segments.end(), [](const SegmentInfo & a, const SegmentInfo & b) { return a.m_start < b.m_start; });
+    }
+
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "recorder");
+#endif
+        std::vector<WsMessage> batch;
+        auto lastFlush = std::chrono::steady_clock::now();
+        unsigned long long lastBytes = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            m_cond.wait_for(lock, FLUSH_INTERVAL, [this]() { return m_stop || !m_queue.empty(); });
+            batch.assign(m_queue.begin(), m_queue.end());
+            m_queue.clear();
+            m_queueBytes = 0;
+            lock.unlock();
+
+            for (const auto & msg : batch) {
+                this->write(msg);
+            }
+            batch.clear();
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastFlush >= FLUSH_INTERVAL) {
+                this->flush(false);
+                std::lock_guard<std::mutex> statsLock(m_segmentsMutex);
+                m_rate = (m_bytes - lastBytes) * 1000 / std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(now - lastFlush).count());
+                lastBytes = m_bytes;
+                lastFlush = now;
+            }
+            lock.lock();
+        }
+        lock.unlock();
+        this->closeSegment();
+    }
+
+    void write(const WsMessage & msg) {
+        const Frame & frame = *msg.m_frame;
+        m_hasVideo = m_hasVideo || msg.m_video;
+        bool sync = frame.isKeyFrame() && (msg.m_video || !m_hasVideo);
+        if (sync && (!m_file.isOpen() || frame.timestamp() >= m_segmentStart + m_segmentDuration || frame.timestamp() < m_segmentStart)) {
+            this->closeSegment();
+            this->openSegment(frame.timestamp());
+        }
+        if (!m_file.isOpen()) {
+            return;
+        }
+
+        // the descriptors of all the tracks start each segment, a change is written before the frame
+        std::shared_ptr<const std::string> & descriptor = m_descriptors[msg.m_track];
+        if (descriptor != msg.m_descriptor) {
+            descriptor = msg.m_descriptor;
+            this->writeRecord(RecordFormat::DESCRIPTOR, reinterpret_cast<const unsigned char*>(descriptor->data()), descriptor->size());
+        }
+        // one index entry per video keyframe, at most one per second for audio only streams
+        if (sync && (msg.m_video || frame.timestamp() >= m_lastIndexTs + 1000000)) {
+            unsigned char entry[RecordFormat::INDEX_ENTRY_SIZE];
+            RecordFormat::put64(entry, frame.timestamp());
+            RecordFormat::put64(entry + 8, m_fileSize);
+            std::lock_guard<std::mutex> lock(m_segmentsMutex);
+            m_index.insert(m_index.end(), entry, entry + sizeof(entry));
+            m_lastIndexTs = frame.timestamp();
+        }
+        this->writeRecord(RecordFormat::FRAME, frame.framed(), frame.framedSize());
+    }
+
+    void writeRecord(uint8_t type, const unsigned char* payload, size_t size) {
+        unsigned char header[RecordFormat::RECORD_HEADER_SIZE] = {0};
+        RecordFormat::put32(header, size);
+        header[4] = type;
+        this->append(header, sizeof(header));
+        this->append(payload, size);
+    }
+
+    void append(const unsigned char* data, size_t size) {
+        while (size > 0) {
+            size_t chunk = std::min(size, BUFFER_SIZE - m_bufferSize);
+            memcpy(m_buffer.get() + m_bufferSize, data, chunk);
+            m_bufferSize += chunk;
+            m_fileSize += chunk;
+            data += chunk;
+            size -= chunk;
+            if (m_bufferSize == BUFFER_SIZE) {
+                this->flush(false);
+            }
+        }
+    }
+
+    // write the buffer padded to a block, the last partial block stays buffered and is written again by the next flush
+    void flush(bool last) {
+        if (!m_file.isOpen() || m_bufferSize == 0) {
+            return;
+        }
+        size_t padded = (m_bufferSize + SegmentFile::BLOCK_SIZE - 1) / SegmentFile::BLOCK_SIZE * SegmentFile::BLOCK_SIZE;
+        memset(m_buffer.get() + m_bufferSize, 0, padded - m_bufferSize);
+        if (!m_file.write(m_buffer.get(), padded, m_fileOffset)) {
+            std::cout << "cannot write segment " << m_current << ":" << strerror(errno) << std::endl;
+        }
+        size_t complete = last ? m_bufferSize : m_bufferSize / SegmentFile::BLOCK_SIZE * SegmentFile::BLOCK_SIZE;
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        m_bytes += complete;
+        m_writes = m_file.writes();
+        m_flushed = m_fileOffset + m_bufferSize;
+        if (!last) {
+            memmove(m_buffer.get(), m_buffer.get() + complete, m_bufferSize - complete);
+            m_bufferSize -= complete;
+            m_fileOffset += complete;
+        }
+    }
+
+    void openSegment(uint64_t start) {
+        std::filesystem::path path = m_dir / (std::to_string(start) + ".r2w");
+        if (!m_file.open(path.string(), m_preallocate)) {
+            std::cout << "cannot open segment " << path << ":" << strerror(errno) << std::endl;
+            return;
+        }
+        m_segmentStart = start;
+        m_bufferSize = 0;
+        m_fileOffset = 0;
+        m_fileSize = 0;
+        m_lastIndexTs = 0;
+        unsigned char header[RecordFormat::FILE_HEADER_SIZE];
+        memcpy(header, RecordFormat::MAGIC, sizeof(RecordFormat::MAGIC));
+        RecordFormat::put32(header + 4, RecordFormat::FORMAT_VERSION);
+        this->append(header, sizeof(header));
+        for (const auto & it : m_descriptors) {
+            this->writeRecord(RecordFormat::DESCRIPTOR, reinterpret_cast<const unsigned char*>(it.second->data()), it.second->size());
+        }
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        m_index.clear();
+        m_flushed = 0;
+        m_current = path.string();
+        m_direct = m_file.direct();
+    }
+
+    void closeSegment() {
+        if (!m_file.isOpen()) {
+            return;
+        }
+        this->flush(true);
+        m_file.close(m_fileSize);
+        // next segment preallocated for the size of this one with some margin
+        m_preallocate = std::max<size_t>(m_fileSize + m_fileSize / 4, SegmentFile::BLOCK_SIZE);
+
+        std::filesystem::path path = m_dir / (std::to_string(m_segmentStart) + ".r2w");
+        std::filesystem::path indexPath = path;
+        indexPath.replace_extension(".idx");
+        FILE* index = fopen(indexPath.string().c_str(), "wb");
+        if (index) {
+            fwrite(m_index.data(), 1, m_index.size(), index);
+            fclose(index);
+        }
+
+        std::lock_guard<std::mutex> lock(m_segmentsMutex);
+        m_segments.push_back(SegmentInfo{m_segmentStart, m_fileSize, path});
+        m_diskBytes += m_fileSize;
+        m_current.clear();
+        this->applyRetention();
+    }
+
+    // called with m_segmentsMutex held
+    void applyRetention() {
+        uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        while (!m_segments.empty()) {
+            const SegmentInfo & oldest = m_segments.front();
+            bool tooBig = m_maxBytes && (m_diskBytes > m_maxBytes);
+            bool tooOld = m_maxAge && (oldest.m_start + m_maxAge * 1000000ULL < now);
+            if (!tooBig && !tooOld) {
+                break;
+            }
+            std::error_code ec;
+            std::filesystem::path indexPath = oldest.m_path;
+            indexPath.replace_extension(".idx");
+            std::filesystem::remove(oldest.m_path, ec);
+            std::filesystem::remove(indexPath, ec);
+            m_diskBytes -= std::min(m_diskBytes, oldest.m_bytes);
+            m_segments.pop_front();
+        }
+    }
+
+private:
+    const std::filesystem::path                                 m_dir;
+    const uint64_t                                              m_segmentDuration;
+    const unsigned long long                                    m_maxBytes;
+    const unsigned int                                          m_maxAge;
+
+    // ingest side
+    std::mutex                                                  m_mutex;
+    std::condition_variable                                     m_cond;
+    std::deque<WsMessage>                                       m_queue;
+    size_t                                                      m_queueBytes;
+    bool                                                        m_waitKeyFrame;
+    bool                                                        m_stop;
+    unsigned long long                                          m_drops;
+
+    // I/O thread side
+    std::unique_ptr<unsigned char[], AlignedFree>               m_buffer;
+    size_t                                                      m_bufferSize;
+    SegmentFile                                                 m_file;
+    uint64_t                                                    m_fileOffset;
+    uint64_t                                                    m_fileSize;
+    uint64_t                                                    m_segmentStart;
+    uint64_t                                                    m_lastIndexTs;
+    bool                                                        m_hasVideo;
+    size_t                                                      m_preallocate;
+    std::map<unsigned char,std::shared_ptr<const std::string>>  m_descriptors;
+
+    // shared with the readers
+    std::mutex                                                  m_segmentsMutex;
+    std::deque<SegmentInfo>                                     m_segments;
+    unsigned long long                                          m_bytes;
+    unsigned long long                                          m_writes;
+    unsigned long long                                          m_rate;
+    uint64_t                                                    m_diskBytes;
+    bool                                                        m_direct;
+    std::string                                                 m_current;
+    std::vector<unsigned char>                                  m_index;
+    uint64_t                                                    m_flushed;
+    std::thread                                                 m_thread;
+};
@@ -0,0 +1,358 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "framebuffer.h"
+
+/*
+ * Last fMP4 segments of a stream for HTTP pulls (LL-HLS and chunked progressive fMP4).
+ * The ingest loop appends fragments, segments start on a keyframe once the target duration is reached
+ * and are cut in parts of the part target duration. Readers wait on the ring, never on the ingest.
+ */
+class SegmentRing {
+    static constexpr size_t MAX_SEGMENTS = 7;
+
+public:
+    struct Part {
+        std::vector<FramePtr>  m_fragments;
+        size_t                 m_size = 0;
+        double                 m_duration = 0;
+        bool                   m_independent = false;
+    };
+
+    struct Segment {
+        uint64_t                            m_sequence = 0;
+        uint64_t                            m_firstFragment = 0;   // global index of its first fragment
+        std::shared_ptr<const std::string>  m_init;
+        unsigned int                        m_initId = 0;
+        bool                                m_discontinuity = false;
+        bool                                m_complete = false;
+        uint64_t                            m_startTs = 0;
+        uint64_t                            m_partStartTs = 0;
+        double                              m_duration = 0;
+        std::vector<Part>                   m_parts;               // completed parts
+        Part                                m_open;                // part being filled
+
+        size_t fragments() const {
+            size_t count = m_open.m_fragments.size();
+            for (const auto & part : m_parts) {
+                count += part.m_fragments.size();
+            }
+            return count;
+        }
+    };
+
+    SegmentRing(double segmentTarget, double partTarget)
+        : m_segmentTarget(segmentTarget), m_partTarget(partTarget), m_nextSequence(0), m_nextFragment(0), m_lastTs(0), m_initId(0),
+          m_discontinuitySequence(0), m_discontinuity(false), m_closed(false), m_version(0), m_playlistVersion(-1) {}
+
+    // how long a blocking request waits
+    std::chrono::milliseconds blockTimeout() const { return std::chrono::milliseconds(static_cast<long long>(3000 * m_segmentTarget)); }
+
+    // called from the ingest loop for each fragment of the video track
+    void add(const std::shared_ptr<const std::string> & init, const FramePtr & fragment) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            uint64_t ts = fragment->timestamp();
+            Segment* current = m_segments.empty() ? nullptr : &m_segments.back();
+            if (current && !current->m_complete && fragment->isKeyFrame() && (ts - current->m_startTs) / 1e6 >= m_segmentTarget) {
+                this->closePart(*current, ts);
+                current->m_duration = (ts - current->m_startTs) / 1e6;
+                current->m_complete = true;
+                current = nullptr;
+            } else if (current && current->m_complete) {
+                current = nullptr;
+            }
+            if (!current) {
+                if (!fragment->isKeyFrame()) {
+                    return;
+                }
+                current = this->openSegment(init, ts);
+            } else if (!current->m_open.m_fragments.empty() && (ts - current->m_partStartTs + ts - m_lastTs) / 1e6 > m_partTarget) {
+                // the part would exceed its target with one more frame
+                this->closePart(*current, ts);
+            }
+            m_lastTs = ts;
+            if (current->m_open.m_fragments.empty()) {
+                current->m_partStartTs = ts;
+                current->m_open.m_independent = fragment->isKeyFrame();
+            }
+            current->m_open.m_fragments.push_back(fragment);
+            current->m_open.m_size += fragment->size();
+            m_nextFragment++;
+            m_version++;
+        }
+        m_cond.notify_all();
+    }
+
+    // the stream restarted, following segments are not continuous with the previous ones
+    void reset() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_segments.empty() && !m_segments.back().m_complete) {
+            Segment & last = m_segments.back();
+            if (!last.m_open.m_fragments.empty()) {
+                last.m_duration = (last.m_partStartTs - last.m_startTs) / 1e6 + m_partTarget;
+                last.m_open.m_duration = m_partTarget;
+                last.m_parts.push_back(std::move(last.m_open));
+                last.m_open = Part();
+            }
+            last.m_complete = true;
+            m_version++;
+        }
+        m_discontinuity = true;
+    }
+
+    // wake up the waiting readers before destruction
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_cond.notify_all();
+    }
+
+    // LL-HLS media playlist, blocking until segment msn (or its part when part >= 0) is available when msn >= 0
+    // returns the HTTP status : 400 when msn is more than two segments ahead, 503 when the wait fails
+    int playlist(long long msn, long long part, std::chrono::milliseconds timeout, std::string & playlist) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (msn >= 0) {
+            // the last segment of the playlist is m_nextSequence - 1
+            if (msn > static_cast<long long>(m_nextSequence) + 1) {
+                return 400;
+            }
+            bool ready = m_cond.wait_for(lock, timeout, [this, msn, part]() { return m_closed || this->hasPart(msn, part); });
+            if (!ready || m_closed) {
+                return 503;
+            }
+        }
+        if (m_playlistVersion != m_version) {
+            m_playlist = this->buildPlaylist();
+            m_playlistVersion = m_version;
+        }
+        playlist = m_playlist;
+        return m_segments.empty() ? 503 : 200;
+    }
+
+    std::shared_ptr<const std::string> init(unsigned int initId) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_segments.rbegin(); it != m_segments.rend(); ++it) {
+            if (it->m_initId == initId) {
+                return it->m_init;
+            }
+        }
+        return nullptr;
+    }
+
+    // fragments of a complete segment, or of one of its parts when part >= 0 (waiting for a hinted part)
+    bool fragments(long long msn, long long part, std::chrono::milliseconds timeout, std::vector<FramePtr> & fragments) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool ready = m_cond.wait_for(lock, timeout, [this, msn, part]() { return m_closed || this->hasPart(msn, part); });
+        const Segment* segment = this->find(msn);
+        if (!ready || m_closed || !segment || (part >= static_cast<long long>(segment->m_parts.size()))) {
+            return false;
+        }
+        if (part < 0) {
+            for (const auto & completed : segment->m_parts) {
+                fragments.insert(fragments.end(), completed.m_fragments.begin(), completed.m_fragments.end());
+            }
+        } else {
+            const Part & completed = segment->m_parts[part];
+            fragments.insert(fragments.end(), completed.m_fragments.begin(), completed.m_fragments.end());
+        }
+        return true;
+    }
+
+    // progressive readers : index of the fragment starting the last segment, with its init segment
+    uint64_t liveStart(std::shared_ptr<const std::string> & init) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_segments.empty()) {
+            return m_nextFragment;
+        }
+        init = m_segments.back().m_init;
+        return m_segments.back().m_firstFragment;
+    }
+
+    // fragments from a global index, waiting for new ones; the index jumps to the live edge when a reader is too late
+    bool next(uint64_t & index, std::chrono::milliseconds timeout, std::vector<FramePtr> & fragments, std::shared_ptr<const std::string> & init) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait_for(lock, timeout, [this, index]() { return m_closed || m_nextFragment > index; });
+        if (m_closed) {
+            return false;
+        }
+        if (!m_segments.empty() && index < m_segments.front().m_firstFragment) {
+            index = m_segments.back().m_firstFragment;
+        }
+        for (const auto & segment : m_segments) {
+            uint64_t first = segment.m_firstFragment;
+            uint64_t last = first + segment.fragments();
+            if (index >= last) {
+                continue;
+            }
+            init = segment.m_init;
+            uint64_t idx = first;
+            auto collect = [&](const Part & part) {
+                for (const auto & fragment : part.m_fragments) {
+                    if (idx++ >= index) {
+                        fragments.push_back(fragment);
+                    }
+                }
+            };
+            for (const auto & part : segment.m_parts) {
+                collect(part);
+            }
+            collect(segment.m_open);
+            index = last;
+            break;
+        }
+        return true;
+    }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        json["segments"] = Json::Value::UInt64(m_segments.size());
+        json["sequence"] = Json::Value::UInt64(m_nextSequence);
+        json["fragments"] = Json::Value::UInt64(m_nextFragment);
+        return json;
+    }
+
+private:
+    Segment* openSegment(const std::shared_ptr<const std::string> & init, uint64_t ts) {
+        if (!m_segments.empty() && m_segments.back().m_init == init) {
+            m_segments.emplace_back();
+            m_segments.back().m_initId = m_initId;
+        } else {
+            m_segments.emplace_back();
+            m_segments.back().m_initId = ++m_initId;
+        }
+        Segment & segment = m_segments.back();
+        segment.m_sequence = m_nextSequence++;
+        segment.m_firstFragment = m_nextFragment;
+        segment.m_init = init;
+        segment.m_discontinuity = m_discontinuity;
+        segment.m_startTs = ts;
+        m_discontinuity = false;
+        while (m_segments.size() > MAX_SEGMENTS) {
+            if (m_segments[1].m_discontinuity) {
+                m_discontinuitySequence++;
+            }
+            m_segments.pop_front();
+        }
+        return &segment;
+    }
+
+    void closePart(Segment & segment, uint64_t ts) {
+        if (segment.m_open.m_fragments.empty()) {
+            return;
+        }
+        segment.m_open.m_duration = (ts - segment.m_partStartTs) / 1e6;
+        segment.m_parts.push_back(std::move(segment.m_open));
+        segment.m_open = Part();
+    }
+
+    const Segment* find(long long msn) const {
+        for (const auto & segment : m_segments) {
+            if (static_cast<long long>(segment.m_sequence) == msn) {
+                return &segment;
+            }
+        }
+        return nullptr;
+    }
+
+    // part of segment msn is completed (the whole segment when part < 0), or it is already out of the ring
+    bool hasPart(long long msn, long long part) const {
+        const Segment* segment = this->find(msn);
+        if (!segment) {
+            return msn < static_cast<long long>(m_nextSequence);
+        }
+        return segment->m_complete || ((part >= 0) && (part < static_cast<long long>(segment->m_parts.size())));
+    }
+
+    std::string buildPlaylist() const {
+        double maxDuration = m_segmentTarget;
+        for (const auto & segment : m_segments) {
+            maxDuration = std::max(maxDuration, segment.m_duration);
+        }
+        char buf[256];
+        std::string out = "#EXTM3U\n#EXT-X-VERSION:9\n";
+        snprintf(buf, sizeof(buf), "#EXT-X-TARGETDURATION:%d\n", static_cast<int>(std::ceil(maxDuration)));
+        out += buf;
+        snprintf(buf, sizeof(buf), "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n#EXT-X-PART-INF:PART-TARGET=%.3f\n", 3 * m_partTarget, m_partTarget);
+        out += buf;
+        if (m_segments.empty()) {
+            return out;
+        }
+        snprintf(buf, sizeof(buf), "#EXT-X-MEDIA-SEQUENCE:%llu\n#EXT-X-DISCONTINUITY-SEQUENCE:%llu\n",
+            static_cast<unsigned long long>(m_segments.front().m_sequence), static_cast<unsigned long long>(m_discontinuitySequence));
+        out += buf;
+
+        unsigned int initId = 0;
+        for (size_t idx = 0; idx < m_segments.size(); ++idx) {
+            const Segment & segment = m_segments[idx];
+            unsigned long long msn = segment.m_sequence;
+            if (segment.m_discontinuity && idx > 0) {
+                out += "#EXT-X-DISCONTINUITY\n";
+            }
+            if (segment.m_initId != initId) {
+                initId = segment.m_initId;
+                snprintf(buf, sizeof(buf), "#EXT-X-MAP:URI=\"init.mp4?id=%u\"\n", initId);
+                out += buf;
+            }
+            // parts are only advertised close to the live edge
+            if (idx + 3 >= m_segments.size()) {
+                for (size_t part = 0; part < segment.m_parts.size(); ++part) {
+                    snprintf(buf, sizeof(buf), "#EXT-X-PART:DURATION=%.5f,URI=\"part.m4s?msn=%llu&part=%zu\"%s\n",
+                        segment.m_parts[part].m_duration, msn, part, segment.m_parts[part].m_independent ? ",INDEPENDENT=YES" : "");
+                    out += buf;
+                }
+            }
+            if (segment.m_complete) {
+                snprintf(buf, sizeof(buf), "#EXTINF:%.5f,\nsegment.m4s?msn=%llu\n", segment.m_duration, msn);
+                out += buf;
+            } else {
+                snprintf(buf, sizeof(buf), "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part.m4s?msn=%llu&part=%zu\"\n", msn, segment.m_parts.size());
+                out += buf;
+            }
+        }
+        return out;
+    }
+
+private:
+    const double                 m_segmentTarget;
+    const double                 m_partTarget;
+    std::mutex                   m_mutex;
+    std::condition_variable      m_cond;
+    std::deque<Segment>          m_segments;
+    uint64_t                     m_nextSequence;
+    uint64_t                     m_nextFragment;
+    uint64_t                     m_lastTs;
+    unsigned int                 m_initId;
+    uint64_t                     m_discontinuitySequence;
+    bool                         m_discontinuity;
+    bool                         m_closed;
+    long long                    m_version;
+    long long                    m_playlistVersion;
+    std::string                  m_playlist;
+};
@@ -19,12 +19,13 @@
 class SessionParams
 {
     public:
-        SessionParams(const std::string& media="", const std::string& codec="", unsigned int rtpfrequency=0, unsigned int channels=0)
-            : m_media(media), m_codec(codec), m_rtpfrequency(rtpfrequency), m_channels(channels) {
+        SessionParams(const std::string& media="", const std::string& codec="", unsigned int rtpfrequency=0, unsigned int channels=0, unsigned char track=0)
+            : m_media(media), m_codec(codec), m_rtpfrequency(rtpfrequency), m_channels(channels), m_track(track) {
         }
 
         std::string m_media;
         std::string m_codec;
         unsigned int m_rtpfrequency;
         unsigned int m_channels;
+        unsigned char m_track;
 };
\ No newline at end of file
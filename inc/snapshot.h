@@ -0,0 +1,346 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <json/json.h>
+
+#ifdef HAVE_FFMPEG
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+#endif
+
+#include "CivetServer.h"
+#include "framebuffer.h"
+
+/*
+ * Software decoding of an H.264/H.265 keyframe, with its parameter sets in front, to a JPEG picture
+ * scaled down to a width. Available when built with -DWITH_FFMPEG=ON.
+ */
+class JpegEncoder {
+    static constexpr int JPEG_QSCALE = 5;
+
+public:
+#ifdef HAVE_FFMPEG
+    static constexpr bool available() { return true; }
+
+    // empty when the keyframe cannot be decoded
+    static std::string encode(const Frame & keyframe, bool h265, int width) {
+        PicturePtr picture = decode(keyframe, h265);
+        if (!picture) {
+            return "";
+        }
+        int w = picture->width;
+        int h = picture->height;
+        if (width > 0 && width < w) {
+            h = (h * width / w) & ~1;
+            w = width & ~1;
+        }
+
+        PicturePtr scaled(av_frame_alloc());
+        scaled->format = AV_PIX_FMT_YUVJ420P;
+        scaled->width = w;
+        scaled->height = h;
+        scaled->pts = 0;
+        if (av_frame_get_buffer(scaled.get(), 0) < 0) {
+            return "";
+        }
+        struct SwsContext* sws = sws_getContext(picture->width, picture->height, static_cast<AVPixelFormat>(picture->format), w, h, AV_PIX_FMT_YUVJ420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!sws) {
+            return "";
+        }
+        sws_scale(sws, picture->data, picture->linesize, 0, picture->height, scaled->data, scaled->linesize);
+        sws_freeContext(sws);
+
+        const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        ContextPtr ctx(codec ? avcodec_alloc_context3(codec) : nullptr);
+        if (!ctx) {
+            return "";
+        }
+        ctx->width = w;
+        ctx->height = h;
+        ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+        ctx->time_base = AVRational{1, 25};
+        ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        ctx->global_quality = FF_QP2LAMBDA * JPEG_QSCALE;
+        scaled->quality = ctx->global_quality;
+        PacketPtr packet(av_packet_alloc());
+        if ((avcodec_open2(ctx.get(), codec, nullptr) < 0) || (avcodec_send_frame(ctx.get(), scaled.get()) < 0) || (avcodec_receive_packet(ctx.get(), packet.get()) < 0)) {
+            return "";
+        }
+        return std::string(reinterpret_cast<const char*>(packet->data), packet->size);
+    }
+
+private:
+    struct Deleter {
+        void operator()(AVCodecContext* ctx) { avcodec_free_context(&ctx); }
+        void operator()(AVFrame* frame) { av_frame_free(&frame); }
+        void operator()(AVPacket* packet) { av_packet_free(&packet); }
+    };
+    using ContextPtr = std::unique_ptr<AVCodecContext, Deleter>;
+    using PicturePtr = std::unique_ptr<AVFrame, Deleter>;
+    using PacketPtr = std::unique_ptr<AVPacket, Deleter>;
+
+    static PicturePtr decode(const Frame & keyframe, bool h265) {
+        const AVCodec* codec = avcodec_find_decoder(h265 ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+        ContextPtr ctx(codec ? avcodec_alloc_context3(codec) : nullptr);
+        if (!ctx) {
+            return nullptr;
+        }
+        ctx->thread_count = 1;
+        if (avcodec_open2(ctx.get(), codec, nullptr) < 0) {
+            return nullptr;
+        }
+        // the decoder reads ahead of the end of the packet
+        std::vector<uint8_t> data(keyframe.size() + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+        memcpy(data.data(), keyframe.data(), keyframe.size());
+        PacketPtr packet(av_packet_alloc());
+        packet->data = data.data();
+        packet->size = keyframe.size();
+        PicturePtr picture(av_frame_alloc());
+        // end of stream flushes the picture out of the decoder
+        if ((avcodec_send_packet(ctx.get(), packet.get()) < 0) || (avcodec_send_packet(ctx.get(), nullptr) < 0) || (avcodec_receive_frame(ctx.get(), picture.get()) < 0)) {
+            return nullptr;
+        }
+        return picture;
+    }
+#else
+    static constexpr bool available() { return false; }
+
+    static std::string encode(const Frame &, bool, int) {
+        return "";
+    }
+#endif
+};
+
+/*
+ * Bounded pool of threads running the snapshot encodings, outside of the RTSP event loops.
+ * A job is refused when the queue is full.
+ */
+class SnapshotWorkers {
+public:
+    SnapshotWorkers(size_t nbThreads, size_t maxQueue) : m_maxQueue(maxQueue), m_stop(false) {
+        for (size_t i = 0; i < nbThreads; ++i) {
+            m_threads.emplace_back([this]() { this->run(); });
+        }
+    }
+
+    SnapshotWorkers(const SnapshotWorkers&) = delete;
+    SnapshotWorkers& operator=(const SnapshotWorkers&) = delete;
+
+    ~SnapshotWorkers() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for (auto & thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    bool submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_jobs.size() >= m_maxQueue) {
+                return false;
+            }
+            m_jobs.push_back(std::move(job));
+        }
+        m_cond.notify_one();
+        return true;
+    }
+
+private:
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "snapshot");
+#endif
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            if (m_jobs.empty()) {
+                m_cond.wait(lock);
+                continue;
+            }
+            std::function<void()> job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+private:
+    const size_t                        m_maxQueue;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_cond;
+    std::deque<std::function<void()>>   m_jobs;
+    bool                                m_stop;
+    std::vector<std::thread>            m_threads;
+};
+
+/*
+ * Result of a snapshot request : the last picture of a JPEG stream sent as is,
+ * or the JPEG encoding of the last keyframe shared by the concurrent requests.
+ */
+struct Snapshot {
+    int                               m_status = 503;
+    FramePtr                          m_frame;
+    std::shared_future<std::string>   m_jpeg;
+};
+
+/*
+ * Last keyframe of a stream and its JPEG encodings by width, kept until the next keyframe.
+ */
+class SnapshotCache {
+    static constexpr size_t MAX_WIDTHS = 4;
+
+public:
+    SnapshotCache() : m_encodings(0) {}
+
+    // called by the ingest for each video frame
+    void update(const FramePtr & frame, const std::string & codec) {
+        bool jpeg = (codec == "jpeg");
+        if (!(jpeg || ((codec == "H264" || codec == "H265") && frame->isKeyFrame()))) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_frame = frame;
+            m_codec = codec;
+            m_jpegs.clear();
+        }
+        m_cond.notify_all();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frame.reset();
+        m_jpegs.clear();
+    }
+
+    // waits a keyframe up to timeout, then starts its encoding unless another request already did
+    Snapshot get(int width, std::chrono::milliseconds timeout, SnapshotWorkers & workers) {
+        Snapshot snapshot;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_cond.wait_for(lock, timeout, [this]() { return m_frame != nullptr; })) {
+            return snapshot;
+        }
+        if (m_codec == "jpeg") {
+            snapshot.m_status = 200;
+            snapshot.m_frame = m_frame;
+            return snapshot;
+        }
+        if (!JpegEncoder::available()) {
+            snapshot.m_status = 501;
+            return snapshot;
+        }
+        auto it = m_jpegs.find(width);
+        if (it == m_jpegs.end()) {
+            auto promise = std::make_shared<std::promise<std::string>>();
+            FramePtr keyframe = m_frame;
+            bool h265 = (m_codec == "H265");
+            if (!workers.submit([promise, keyframe, h265, width]() { promise->set_value(JpegEncoder::encode(*keyframe, h265, width)); })) {
+                return snapshot;
+            }
+            m_encodings++;
+            if (m_jpegs.size() >= MAX_WIDTHS) {
+                m_jpegs.clear();
+            }
+            it = m_jpegs.insert(std::make_pair(width, promise->get_future().share())).first;
+        }
+        snapshot.m_status = 200;
+        snapshot.m_jpeg = it->second;
+        return snapshot;
+    }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        json["available"] = (m_frame != nullptr);
+        json["timestamp"] = Json::Value::UInt64(m_frame ? m_frame->timestamp() : 0);
+        json["encodings"] = Json::Value::UInt64(m_encodings);
+        return json;
+    }
+
+private:
+    std::mutex                                        m_mutex;
+    std::condition_variable                           m_cond;
+    FramePtr                                          m_frame;
+    std::string                                       m_codec;
+    std::map<int,std::shared_future<std::string>>     m_jpegs;
+    unsigned long long                                m_encodings;
+};
+
+/*
+ * JPEG picture of a stream on /api/snapshot/<name>?width=N
+ */
+class SnapshotHandler : public CivetHandler {
+    static constexpr std::chrono::seconds TIMEOUT = std::chrono::seconds(5);
+
+public:
+    using Lookup = std::function<Snapshot(const std::string & wsurl, int width, std::chrono::milliseconds timeout)>;
+
+    SnapshotHandler(const std::string & prefix, Lookup lookup) : m_prefix(prefix), m_lookup(lookup) {}
+
+    bool handleGet(CivetServer *server, struct mg_connection *conn) override {
+        const struct mg_request_info *req_info = mg_get_request_info(conn);
+        std::string wsurl = std::string(req_info->local_uri).substr(m_prefix.size());
+        int width = 0;
+        char value[16];
+        if (req_info->query_string && mg_get_var(req_info->query_string, strlen(req_info->query_string), "width", value, sizeof(value)) > 0) {
+            width = atoi(value);
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+        Snapshot snapshot = m_lookup(wsurl, width, TIMEOUT);
+        if (snapshot.m_status == 404) {
+            mg_send_http_error(conn, 404, "%s", "unknown stream");
+        } else if (snapshot.m_status == 501) {
+            mg_send_http_error(conn, 501, "%s", "built without video decoder");
+        } else if (snapshot.m_frame) {
+            this->send(conn, reinterpret_cast<const char*>(snapshot.m_frame->data()), snapshot.m_frame->size());
+        } else if (snapshot.m_jpeg.valid() && (snapshot.m_jpeg.wait_until(deadline) == std::future_status::ready) && !snapshot.m_jpeg.get().empty()) {
+            const std::string & jpeg = snapshot.m_jpeg.get();
+            this->send(conn, jpeg.data(), jpeg.size());
+        } else {
+            mg_send_http_error(conn, 503, "%s", "snapshot not available");
+        }
+        return true;
+    }
+
+private:
+    void send(struct mg_connection *conn, const char* data, size_t size) {
+        mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nCache-Control: no-cache\r\nContent-Length: %zu\r\n\r\n", size);
+        mg_write(conn, data, size);
+    }
+
+private:
+    const std::string  m_prefix;
+    Lookup             m_lookup;
+};
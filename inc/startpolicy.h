@@ -0,0 +1,116 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include <json/json.h>
+
+/*
+ * When the RTSP connection of a stream runs, and how long viewers wait for it:
+ *  - always   : started with the server, never stopped
+ *  - linger   : started by the first viewer, stopped `linger` seconds after the last one left
+ *  - ondemand : started by the first viewer, stopped when the last one leaves
+ */
+class StartPolicy {
+    static constexpr unsigned int DEFAULT_LINGER = 30;
+
+public:
+    enum Mode { ALWAYS, LINGER, ONDEMAND };
+
+    StartPolicy(const Json::Value & config)
+        : m_mode(parseMode(config.get("policy", "ondemand").asString())), m_linger(config.get("linger", DEFAULT_LINGER).asUInt()),
+          m_waitFrame(false), m_waitKeyFrame(false), m_starts(0), m_startupDelay(-1), m_keyFrameDelay(-1), m_viewers(0), m_viewerDelaySum(0) {}
+
+    Mode mode() const { return m_mode; }
+    unsigned int linger() const { return m_linger; }
+
+    void onStart() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_start = std::chrono::steady_clock::now();
+        m_waitFrame = true;
+        m_waitKeyFrame = true;
+        m_starts++;
+    }
+
+    void onFrame(bool keyframe) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_waitFrame) {
+            m_waitFrame = false;
+            m_startupDelay = elapsed();
+        }
+        if (m_waitKeyFrame && keyframe) {
+            m_waitKeyFrame = false;
+            m_keyFrameDelay = elapsed();
+        }
+    }
+
+    void onViewerFirstFrame(long long delay) {
+        if (delay >= 0) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_viewers++;
+            m_viewerDelaySum += delay;
+        }
+    }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        json["policy"] = modeName(m_mode);
+        if (m_mode == LINGER) {
+            json["linger"] = m_linger;
+        }
+        json["starts"] = Json::Value::UInt64(m_starts);
+        json["startupMs"] = Json::Value::Int64(m_startupDelay);
+        json["keyframeWaitMs"] = Json::Value::Int64(m_keyFrameDelay);
+        json["viewerFirstFrameMs"] = Json::Value::Int64(m_viewers ? m_viewerDelaySum / m_viewers : -1);
+        return json;
+    }
+
+private:
+    long long elapsed() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    static Mode parseMode(const std::string & mode) {
+        if (mode == "always") {
+            return ALWAYS;
+        } else if (mode == "linger") {
+            return LINGER;
+        }
+        return ONDEMAND;
+    }
+
+    static const char* modeName(Mode mode) {
+        switch (mode) {
+            case ALWAYS: return "always";
+            case LINGER: return "linger";
+            default:     return "ondemand";
+        }
+    }
+
+private:
+    const Mode                             m_mode;
+    const unsigned int                     m_linger;
+    std::mutex                             m_mutex;
+    std::chrono::steady_clock::time_point  m_start;
+    bool                                   m_waitFrame;
+    bool                                   m_waitKeyFrame;
+    unsigned long long                     m_starts;
+    long long                              m_startupDelay;
+    long long                              m_keyFrameDelay;
+    unsigned long long                     m_viewers;
+    long long                              m_viewerDelaySum;
+};
@@ -0,0 +1,194 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "framebuffer.h"
+
+/*
+ * Video thinning of a websocket connection, selected with ?mode=keyframes or ?maxfps=N on the websocket url.
+ * Audio is not filtered.
+ */
+struct SubstreamSpec {
+    bool          m_keyframes = false;
+    unsigned int  m_maxfps = 0;
+
+    bool full() const { return !m_keyframes && m_maxfps == 0; }
+    bool operator==(const SubstreamSpec & other) const { return m_keyframes == other.m_keyframes && m_maxfps == other.m_maxfps; }
+
+    std::string name() const {
+        if (m_keyframes) {
+            return "keyframes";
+        } else if (m_maxfps) {
+            return "maxfps=" + std::to_string(m_maxfps);
+        }
+        return "full";
+    }
+};
+
+inline SubstreamSpec parseSubstream(const std::string & mode, unsigned int maxfps) {
+    SubstreamSpec spec;
+    spec.m_keyframes = (mode == "keyframes");
+    spec.m_maxfps = spec.m_keyframes ? 0 : maxfps;
+    return spec;
+}
+
+// substream of a websocket connection from its query string, defaulting to the substream of its url
+inline SubstreamSpec parseSubstream(const char* query, const SubstreamSpec & defaultSpec) {
+    SubstreamSpec spec = defaultSpec;
+    const char* mode = query ? strstr(query, "mode=") : nullptr;
+    if (mode) {
+        mode += strlen("mode=");
+        spec = parseSubstream(std::string(mode, strcspn(mode, "&")), 0);
+    }
+    const char* maxfps = query ? strstr(query, "maxfps=") : nullptr;
+    if (maxfps && !spec.m_keyframes) {
+        spec.m_maxfps = strtoul(maxfps + strlen("maxfps="), nullptr, 10);
+    }
+    return spec;
+}
+
+/*
+ * Filters of the substreams requested by the viewers of a stream, evaluated once per frame
+ * whatever the number of viewers : select() returns the mask of the substreams keeping the frame.
+ *
+ * Frames are dropped using the classification of the codec handler :
+ *  - keyframes only keeps the IDR pictures,
+ *  - maxfps keeps the frames spaced by at least 1/maxfps, disposable frames are dropped freely,
+ *    dropping a reference frame drops the rest of the GOP as the next frames could not be decoded.
+ */
+class SubstreamFilters {
+public:
+    static constexpr int MAX_SUBSTREAMS = 32;
+    static constexpr int FULL = -1;
+
+    // index of the substream shared by the viewers with the same spec, FULL for the unfiltered stream
+    int acquire(const SubstreamSpec & spec) {
+        if (spec.full()) {
+            return FULL;
+        }
+        int unused = FULL;
+        for (size_t i = 0; i < m_substreams.size(); ++i) {
+            if (m_substreams[i].m_users && m_substreams[i].m_spec == spec) {
+                m_substreams[i].m_users++;
+                return i;
+            }
+            if (!m_substreams[i].m_users && unused == FULL) {
+                unused = i;
+            }
+        }
+        if (unused == FULL) {
+            if (m_substreams.size() >= MAX_SUBSTREAMS) {
+                return FULL;
+            }
+            unused = m_substreams.size();
+            m_substreams.emplace_back();
+        }
+        Substream & substream = m_substreams[unused];
+        substream = Substream();
+        substream.m_spec = spec;
+        substream.m_users = 1;
+        return unused;
+    }
+
+    void release(int index) {
+        if (index != FULL && m_substreams[index].m_users) {
+            m_substreams[index].m_users--;
+        }
+    }
+
+    std::string name(int index) const {
+        return (index == FULL) ? "full" : m_substreams[index].m_spec.name();
+    }
+
+    // substreams keeping a video frame
+    uint32_t select(const Frame & frame) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < m_substreams.size(); ++i) {
+            Substream & substream = m_substreams[i];
+            if (substream.m_users && substream.keep(frame)) {
+                mask |= (1u << i);
+            }
+        }
+        return mask;
+    }
+
+    static bool selected(uint32_t mask, int index) {
+        return (index == FULL) || (mask & (1u << index));
+    }
+
+    Json::Value toJSON() const {
+        Json::Value json(Json::arrayValue);
+        for (const auto & substream : m_substreams) {
+            if (substream.m_users) {
+                Json::Value entry;
+                entry["mode"] = substream.m_spec.name();
+                entry["viewers"] = substream.m_users;
+                entry["frames"] = Json::Value::UInt64(substream.m_kept);
+                entry["dropped"] = Json::Value::UInt64(substream.m_dropped);
+                json.append(entry);
+            }
+        }
+        return json;
+    }
+
+private:
+    struct Substream {
+        SubstreamSpec       m_spec;
+        unsigned int        m_users = 0;
+        bool                m_broken = true;
+        uint64_t            m_nextTs = 0;
+        unsigned long long  m_kept = 0;
+        unsigned long long  m_dropped = 0;
+
+        bool keep(const Frame & frame) {
+            bool keep = this->accept(frame);
+            if (keep) {
+                m_kept++;
+            } else {
+                m_dropped++;
+            }
+            return keep;
+        }
+
+        bool accept(const Frame & frame) {
+            uint64_t interval = m_spec.m_maxfps ? 1000000 / m_spec.m_maxfps : 0;
+            if (frame.isKeyFrame()) {
+                m_broken = false;
+                m_nextTs = frame.timestamp() + interval;
+                return true;
+            }
+            if (m_spec.m_keyframes || m_broken) {
+                return false;
+            }
+            if (frame.timestamp() < m_nextTs) {
+                m_broken = !frame.isDisposable();
+                return false;
+            }
+            m_nextTs += interval;
+            if (m_nextTs <= frame.timestamp()) {
+                m_nextTs = frame.timestamp() + interval;
+            }
+            return true;
+        }
+    };
+
+    std::vector<Substream>  m_substreams;
+};
@@ -0,0 +1,293 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include <json/json.h>
+
+/*
+ * Per-frame latency tracing, enabled with the -T option.
+ * Each thread records its trace points in a ring of its own : the owner thread is the only writer,
+ * a dump copies the rings and ignores the slots overwritten while it was reading them.
+ * Frames are followed by stream, track and presentation timestamp from the RTP receive to each socket write.
+ * When disabled a trace point is a relaxed load of a flag.
+ */
+class Tracer {
+public:
+    enum Stage : uint8_t {
+        RECEIVE,    // RTP payload delivered by the sink to WsStream::onData
+        HANDLED,    // frame produced by the codec handler
+        PUBLISHED,  // frame queued to the subscribers
+        SENT,       // frame written to a websocket
+        NB_STAGES
+    };
+
+    static const char* stageName(int stage) {
+        static const char* names[NB_STAGES] = { "receive", "handler", "publish", "send" };
+        return stage < NB_STAGES ? names[stage] : "";
+    }
+
+    static Tracer & instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void trace(Stage stage, uint16_t stream, uint8_t track, uint64_t pts) {
+        if (enabled()) {
+            instance().ring().record(stage, stream, track, pts);
+        }
+    }
+
+    // events kept per thread, rounded up to a power of two, 0 disables the tracing
+    void enable(size_t events) {
+        size_t size = 1;
+        while (size < events) {
+            size <<= 1;
+        }
+        m_ringSize = size;
+        m_wallOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+                     - std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        s_enabled.store(events != 0, std::memory_order_relaxed);
+    }
+
+    // identifier of a stream in the trace points
+    uint16_t stream(const std::string & name) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_streams.push_back(name);
+        return m_streams.size() - 1;
+    }
+
+    // Chrome trace-event JSON of the rings, with the latency percentiles per stage in microseconds
+    Json::Value toJSON() {
+        std::vector<Event> events;
+        std::vector<std::string> streams;
+        Json::Value traceEvents(Json::arrayValue);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            streams = m_streams;
+            for (const auto & ring : m_rings) {
+                unsigned int tid = ring->m_tid.load(std::memory_order_acquire);
+                ring->snapshot(events, tid);
+                Json::Value name;
+                name["name"] = "thread_name";
+                name["ph"] = "M";
+                name["pid"] = 0;
+                name["tid"] = tid;
+                name["args"]["name"] = ring->m_name;
+                traceEvents.append(name);
+            }
+        }
+        std::sort(events.begin(), events.end(), [](const Event & a, const Event & b) { return a.m_time < b.m_time; });
+
+        // first occurrence of each stage of a frame, the sends are matched with their publish
+        std::map<std::tuple<uint16_t,uint8_t,uint64_t>, std::array<int64_t, NB_STAGES>> frames;
+        std::vector<int64_t> latencies[NB_STAGES + 1];
+        for (const Event & event : events) {
+            auto key = std::make_tuple(event.m_stream, event.m_track, event.m_pts);
+            auto it = frames.find(key);
+            if (it == frames.end()) {
+                std::array<int64_t, NB_STAGES> times;
+                times.fill(-1);
+                it = frames.insert(std::make_pair(key, times)).first;
+            }
+            std::array<int64_t, NB_STAGES> & times = it->second;
+            if (event.m_stage == RECEIVE) {
+                if (times[RECEIVE] < 0) {
+                    // delay between the capture and the reception, meaningful once the RTP clock is synchronized by RTCP
+                    latencies[NB_STAGES].push_back((event.m_time + m_wallOffset) / 1000 - static_cast<int64_t>(event.m_pts));
+                }
+            } else if (times[event.m_stage - 1] >= 0) {
+                int64_t duration = (event.m_time - times[event.m_stage - 1]) / 1000;
+                latencies[event.m_stage].push_back(duration);
+
+                Json::Value span;
+                span["name"] = stageName(event.m_stage);
+                span["ph"] = "X";
+                span["pid"] = 0;
+                span["tid"] = event.m_tid;
+                span["ts"] = times[event.m_stage - 1] / 1000.0;
+                span["dur"] = Json::Value::Int64(duration);
+                span["args"]["stream"] = event.m_stream < streams.size() ? streams[event.m_stream] : "";
+                span["args"]["track"] = event.m_track;
+                span["args"]["pts"] = Json::Value::UInt64(event.m_pts);
+                traceEvents.append(span);
+            }
+            if (event.m_stage != SENT && times[event.m_stage] < 0) {
+                times[event.m_stage] = event.m_time;
+            }
+        }
+
+        Json::Value json;
+        json["traceEvents"] = traceEvents;
+        json["displayTimeUnit"] = "ms";
+        Json::Value stages;
+        stages["capture"] = percentiles(latencies[NB_STAGES]);
+        for (int stage = HANDLED; stage < NB_STAGES; ++stage) {
+            stages[stageName(stage)] = percentiles(latencies[stage]);
+        }
+        json["stages"] = stages;
+        return json;
+    }
+
+private:
+    struct Event {
+        int64_t       m_time;
+        uint64_t      m_pts;
+        uint16_t      m_stream;
+        uint8_t       m_track;
+        uint8_t       m_stage;
+        unsigned int  m_tid;
+    };
+
+    class Ring {
+    public:
+        explicit Ring(size_t size) : m_slots(new Slot[size]), m_mask(size - 1), m_head(0), m_tid(0), m_used(true) {}
+
+        void record(Stage stage, uint16_t stream, uint8_t track, uint64_t pts) {
+            uint64_t head = m_head.load(std::memory_order_relaxed);
+            Slot & slot = m_slots[head & m_mask];
+            slot.m_time.store(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+            slot.m_pts.store(pts, std::memory_order_relaxed);
+            slot.m_id.store((uint32_t(stream) << 16) | (uint32_t(track) << 8) | stage, std::memory_order_relaxed);
+            m_head.store(head + 1, std::memory_order_release);
+        }
+
+        // called by a new owner before it records
+        void reset() { m_head.store(0, std::memory_order_release); }
+
+        void snapshot(std::vector<Event> & events, unsigned int tid) const {
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            uint64_t size = m_mask + 1;
+            uint64_t begin = head > size ? head - size : 0;
+            size_t first = events.size();
+            for (uint64_t pos = begin; pos < head; ++pos) {
+                const Slot & slot = m_slots[pos & m_mask];
+                uint32_t id = slot.m_id.load(std::memory_order_relaxed);
+                events.push_back(Event{slot.m_time.load(std::memory_order_relaxed), slot.m_pts.load(std::memory_order_relaxed), uint16_t(id >> 16), uint8_t(id >> 8), uint8_t(id), tid});
+            }
+            // the writer went on meanwhile, drop the slots it may have overwritten
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = m_head.load(std::memory_order_relaxed);
+            if (after > begin + size) {
+                size_t overwritten = std::min<uint64_t>(after - begin - size, head - begin);
+                events.erase(events.begin() + first, events.begin() + first + overwritten);
+            }
+        }
+
+    private:
+        struct Slot {
+            std::atomic<int64_t>   m_time{0};
+            std::atomic<uint64_t>  m_pts{0};
+            std::atomic<uint32_t>  m_id{0};
+        };
+
+        std::unique_ptr<Slot[]>  m_slots;
+        const uint64_t           m_mask;
+        std::atomic<uint64_t>    m_head;
+
+    public:
+        std::atomic<unsigned int>  m_tid;
+        std::string                m_name;   // guarded by the tracer mutex
+        bool                       m_used;   // guarded by the tracer mutex
+    };
+
+    // gives back the ring of a thread when it exits, its events are kept until another thread takes it
+    struct RingOwner {
+        Ring* m_ring = nullptr;
+        ~RingOwner() {
+            if (m_ring) {
+                Tracer::instance().release(m_ring);
+            }
+        }
+    };
+
+    Tracer() : m_ringSize(0), m_wallOffset(0), m_nextTid(1) {}
+
+    Ring & ring() {
+        thread_local RingOwner owner;
+        if (!owner.m_ring) {
+            owner.m_ring = this->acquire();
+        }
+        return *owner.m_ring;
+    }
+
+    Ring* acquire() {
+        std::string name;
+#ifndef _WIN32
+        char buffer[16] = {0};
+        if (pthread_getname_np(pthread_self(), buffer, sizeof(buffer)) == 0) {
+            name = buffer;
+        }
+#endif
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Ring* ring = nullptr;
+        for (const auto & free : m_rings) {
+            if (!free->m_used) {
+                ring = free.get();
+                break;
+            }
+        }
+        if (!ring) {
+            m_rings.push_back(std::make_unique<Ring>(m_ringSize));
+            ring = m_rings.back().get();
+        }
+        ring->reset();
+        ring->m_used = true;
+        ring->m_name = name;
+        ring->m_tid.store(m_nextTid++, std::memory_order_release);
+        return ring;
+    }
+
+    void release(Ring* ring) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ring->m_used = false;
+    }
+
+    static Json::Value percentiles(std::vector<int64_t> & values) {
+        Json::Value json;
+        json["count"] = Json::Value::UInt64(values.size());
+        if (!values.empty()) {
+            std::sort(values.begin(), values.end());
+            json["p50"] = Json::Value::Int64(values[values.size() * 50 / 100]);
+            json["p90"] = Json::Value::Int64(values[values.size() * 90 / 100]);
+            json["p99"] = Json::Value::Int64(values[values.size() * 99 / 100]);
+            json["max"] = Json::Value::Int64(values.back());
+        }
+        return json;
+    }
+
+private:
+    static inline std::atomic<bool>          s_enabled{false};
+    std::mutex                               m_mutex;
+    std::vector<std::unique_ptr<Ring>>       m_rings;
+    std::vector<std::string>                 m_streams;
+    size_t                                   m_ringSize;
+    int64_t                                  m_wallOffset;
+    unsigned int                             m_nextTid;
+};
@@ -0,0 +1,651 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
+#include <json/json.h>
+
+#include "liveMedia.hh"
+#include "GroupsockHelper.hh"
+#include "rtspconnectionclient.h"
+
+#include "metrics.h"
+
+// RTP fixed header fields, returns false when the packet is not RTP version 2
+inline bool parseRtpHeader(const unsigned char* packet, size_t size, uint16_t & seq, uint32_t & ts, bool & marker, size_t & offset, size_t & length) {
+    if (size < 12 || (packet[0] >> 6) != 2) {
+        return false;
+    }
+    offset = 12 + 4 * (packet[0] & 0x0f);
+    if (packet[0] & 0x10) {
+        if (size < offset + 4) {
+            return false;
+        }
+        offset += 4 + 4 * ((packet[offset + 2] << 8) | packet[offset + 3]);
+    }
+    size_t padding = (packet[0] & 0x20) ? packet[size - 1] : 0;
+    if (size < offset + padding) {
+        return false;
+    }
+    length = size - offset - padding;
+    marker = packet[1] & 0x80;
+    seq = (packet[2] << 8) | packet[3];
+    ts = (uint32_t(packet[4]) << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+    return true;
+}
+
+/*
+ * H.264 (RFC 6184) and H.265 (RFC 7798) payloads to NAL units with a start code, as the live555 sink delivers them.
+ * Single NAL units and aggregated ones are given in place, the start code overwriting the bytes in front of them :
+ * the RTP header, or the end of the previous unit that was consumed by then.
+ * Fragmented units are reassembled, a fragment lost drops the unit.
+ */
+class RtpDepacketizer {
+    static constexpr size_t MAX_NAL_SIZE = 4*1024*1024;
+
+public:
+    explicit RtpDepacketizer(bool h265) : m_h265(h265), m_fragmented(false) {}
+
+    template <typename Deliver>
+    void packet(unsigned char* payload, size_t size, bool lost, Deliver deliver) {
+        if (lost) {
+            m_fragmented = false;
+        }
+        size_t header = m_h265 ? 2 : 1;
+        if (size <= header) {
+            return;
+        }
+        int type = m_h265 ? (payload[0] >> 1) & 0x3f : payload[0] & 0x1f;
+        if ((!m_h265 && type == 24) || (m_h265 && type == 48)) {
+            this->aggregated(payload + header, size - header, deliver);
+        } else if ((!m_h265 && type == 28) || (m_h265 && type == 49)) {
+            this->fragment(payload, size, deliver);
+        } else if (m_h265 ? (type < 48) : (type >= 1 && type <= 23)) {
+            this->single(payload, size, deliver);
+        }
+    }
+
+private:
+    template <typename Deliver>
+    void single(unsigned char* nal, size_t size, Deliver deliver) {
+        memcpy(nal - sizeof(H26X_marker), H26X_marker, sizeof(H26X_marker));
+        deliver(nal - sizeof(H26X_marker), size + sizeof(H26X_marker));
+    }
+
+    // STAP-A / AP : 16 bits size before each unit
+    template <typename Deliver>
+    void aggregated(unsigned char* data, size_t size, Deliver deliver) {
+        while (size > 2) {
+            size_t length = (data[0] << 8) | data[1];
+            data += 2;
+            size -= 2;
+            if (length == 0 || length > size) {
+                return;
+            }
+            this->single(data, length, deliver);
+            data += length;
+            size -= length;
+        }
+    }
+
+    // FU-A / FU : the NAL unit header is rebuilt from the payload header and the fragment header
+    template <typename Deliver>
+    void fragment(const unsigned char* payload, size_t size, Deliver deliver) {
+        size_t header = m_h265 ? 3 : 2;
+        if (size <= header) {
+            return;
+        }
+        unsigned char fu = payload[header - 1];
+        bool start = fu & 0x80;
+        bool end = fu & 0x40;
+        if (start) {
+            m_nal.assign(H26X_marker, H26X_marker + sizeof(H26X_marker));
+            if (m_h265) {
+                m_nal.push_back((payload[0] & 0x81) | ((fu & 0x3f) << 1));
+                m_nal.push_back(payload[1]);
+            } else {
+                m_nal.push_back((payload[0] & 0xe0) | (fu & 0x1f));
+            }
+            m_fragmented = true;
+        } else if (!m_fragmented) {
+            return;
+        }
+        if (m_nal.size() + size > MAX_NAL_SIZE) {
+            m_fragmented = false;
+            return;
+        }
+        m_nal.insert(m_nal.end(), payload + header, payload + size);
+        if (end) {
+            m_fragmented = false;
+            deliver(m_nal.data(), m_nal.size());
+        }
+    }
+
+private:
+    const bool                  m_h265;
+    bool                        m_fragmented;
+    std::vector<unsigned char>  m_nal;
+};
+
+/*
+ * RTP socket read in batches with recvmmsg into a preallocated arena of packet slots.
+ * Packets wait in their slot until their sequence number is next, a gap is skipped once REORDER packets
+ * are held behind it or the oldest of them waited MAX_WAIT, older or duplicated packets are dropped.
+ */
+class RtpReceiver {
+    static constexpr size_t SLOTS = 256;
+    static constexpr size_t SLOT_SIZE = 2048;
+    static constexpr size_t BATCH = 32;
+    static constexpr size_t REORDER = 32;
+    static constexpr std::chrono::milliseconds MAX_WAIT = std::chrono::milliseconds(20);
+
+public:
+    struct Stats {
+        Counter  m_packets;
+        Counter  m_syscalls;
+        Counter  m_reordered;
+        Counter  m_lost;
+        Counter  m_late;
+
+        Json::Value toJSON() const {
+            Json::Value json;
+            json["packets"] = Json::Value::UInt64(m_packets.value());
+            json["syscalls"] = Json::Value::UInt64(m_syscalls.value());
+            json["packetsPerSyscall"] = m_syscalls.value() ? double(m_packets.value()) / m_syscalls.value() : 0.0;
+            json["reordered"] = Json::Value::UInt64(m_reordered.value());
+            json["lost"] = Json::Value::UInt64(m_lost.value());
+            json["late"] = Json::Value::UInt64(m_late.value());
+            return json;
+        }
+    };
+
+    RtpReceiver(int fd, Stats & stats) : m_fd(fd), m_stats(stats), m_arena(new unsigned char[SLOTS * SLOT_SIZE]), m_size(SLOTS, 0), m_arrival(SLOTS), m_held(0), m_expected(0), m_highest(0), m_started(false), m_lost(false) {
+        for (size_t slot = 0; slot < SLOTS; ++slot) {
+            m_free.push_back(SLOTS - 1 - slot);
+            m_bySeq[slot] = -1;
+        }
+    }
+
+    // drain the socket, the callback gets the packets in sequence order with the lost flag set after a gap
+    template <typename Callback>
+    void read(Callback callback) {
+        size_t received = 0;
+        do {
+            received = this->receive();
+            this->release(callback);
+        } while (received == BATCH);
+    }
+
+private:
+    unsigned char* slot(int slot) { return m_arena.get() + slot * SLOT_SIZE; }
+
+    size_t receive() {
+        size_t count = std::min(BATCH, m_free.size());
+        if (count == 0) {
+            return 0;
+        }
+        int slots[BATCH];
+        for (size_t i = 0; i < count; ++i) {
+            slots[i] = m_free[m_free.size() - 1 - i];
+        }
+        int received = 0;
+#ifdef __linux__
+        struct mmsghdr msgs[BATCH];
+        struct iovec iovecs[BATCH];
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < count; ++i) {
+            iovecs[i].iov_base = this->slot(slots[i]);
+            iovecs[i].iov_len = SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        received = recvmmsg(m_fd, msgs, count, MSG_DONTWAIT, nullptr);
+        m_stats.m_syscalls.add();
+        for (int i = 0; i < received; ++i) {
+            m_size[slots[i]] = msgs[i].msg_len;
+        }
+#else
+        while (size_t(received) < count) {
+            int size = recv(m_fd, reinterpret_cast<char*>(this->slot(slots[received])), SLOT_SIZE, 0);
+            m_stats.m_syscalls.add();
+            if (size <= 0) {
+                break;
+            }
+            m_size[slots[received++]] = size;
+        }
+#endif
+        if (received <= 0) {
+            return 0;
+        }
+        m_free.resize(m_free.size() - received);
+        m_stats.m_packets.add(received);
+        auto now = std::chrono::steady_clock::now();
+        for (int i = 0; i < received; ++i) {
+            m_arrival[slots[i]] = now;
+            this->insert(slots[i]);
+        }
+        return received;
+    }
+
+    void insert(int slot) {
+        const unsigned char* packet = this->slot(slot);
+        if (m_size[slot] < 12) {
+            m_free.push_back(slot);
+            return;
+        }
+        uint16_t seq = (packet[2] << 8) | packet[3];
+        if (!m_started) {
+            m_expected = seq;
+            m_highest = seq;
+            m_started = true;
+        }
+        int16_t distance = static_cast<int16_t>(seq - m_expected);
+        if (distance < 0 || distance >= static_cast<int16_t>(SLOTS) || m_bySeq[seq % SLOTS] >= 0) {
+            // late, duplicated or too far ahead to wait for the gap
+            m_free.push_back(slot);
+            m_stats.m_late.add();
+            if (distance >= static_cast<int16_t>(SLOTS)) {
+                this->restart(seq);
+            }
+            return;
+        }
+        if (static_cast<int16_t>(seq - m_highest) < 0) {
+            m_stats.m_reordered.add();
+        } else {
+            m_highest = seq;
+        }
+        m_bySeq[seq % SLOTS] = slot;
+        m_held++;
+    }
+
+    // the stream jumped, forget the held packets
+    void restart(uint16_t seq) {
+        for (auto & slot : m_bySeq) {
+            if (slot >= 0) {
+                m_free.push_back(slot);
+                slot = -1;
+            }
+        }
+        m_held = 0;
+        m_expected = seq;
+        m_highest = seq;
+        m_lost = true;
+    }
+
+    bool expired() const {
+        auto oldest = std::chrono::steady_clock::time_point::max();
+        for (int slot : m_bySeq) {
+            if (slot >= 0) {
+                oldest = std::min(oldest, m_arrival[slot]);
+            }
+        }
+        return std::chrono::steady_clock::now() - oldest > MAX_WAIT;
+    }
+
+    template <typename Callback>
+    void release(Callback callback) {
+        while (m_held > 0) {
+            int & slot = m_bySeq[m_expected % SLOTS];
+            if (slot < 0) {
+                if (m_held < REORDER && !this->expired()) {
+                    return;
+                }
+                // give up waiting for the missing packet
+                m_stats.m_lost.add();
+                m_lost = true;
+                m_expected++;
+                continue;
+            }
+            callback(this->slot(slot), m_size[slot], m_lost);
+            m_lost = false;
+            m_free.push_back(slot);
+            slot = -1;
+            m_held--;
+            m_expected++;
+        }
+    }
+
+private:
+    const int                         m_fd;
+    Stats &                           m_stats;
+    std::unique_ptr<unsigned char[]>  m_arena;
+    std::vector<size_t>               m_size;
+    std::vector<std::chrono::steady_clock::time_point> m_arrival;
+    std::vector<int>                  m_free;
+    int                               m_bySeq[SLOTS];
+    size_t                            m_held;
+    uint16_t                          m_expected;
+    uint16_t                          m_highest;
+    bool                              m_started;
+    bool                              m_lost;
+};
+
+/*
+ * RTSP session whose H.264/H.265 RTP is read by RtpReceiver instead of the live555 RTP sources,
+ * for the UDP and multicast transports. The other media go through a live555 sink.
+ * It runs on the event loop of its environment and gives the NAL units to the callbacks of RTSPConnection,
+ * the presentation time is extrapolated from the RTP timestamps of the first packet and the local clock.
+ * The times of the live555 sink are moved to this timebase so the tracks stay synchronized, RTCP is not applied.
+ * Errors and data timeouts reconnect after a delay.
+ */
+class UdpIngest {
+    static constexpr unsigned int RECONNECT_DELAY = 10;
+    static constexpr unsigned int DATA_TIMEOUT = 10;
+    static constexpr unsigned int RECEIVE_BUFFER = 4*1024*1024;
+    static constexpr unsigned int SINK_BUFFER = 512*1024;
+
+public:
+    static constexpr bool available() {
+#ifdef __linux__
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    UdpIngest(Environment & env, RTSPConnection::Callback* callback, const std::string & url, bool multicast, int verbose)
+        : m_env(env), m_callback(callback), m_url(url), m_multicast(multicast), m_verbose(verbose),
+          m_client(nullptr), m_session(nullptr), m_current(nullptr), m_task(nullptr), m_packets(0), m_lastPackets(0) {}
+
+    UdpIngest(const UdpIngest&) = delete;
+    UdpIngest& operator=(const UdpIngest&) = delete;
+
+    ~UdpIngest() {
+        this->stop();
+    }
+
+    // called on the event loop, like RTSPConnection
+    void start(unsigned int delay = 0) {
+        this->stop();
+        m_task = m_env.taskScheduler().scheduleDelayedTask(delay * 1000000LL, connect, this);
+    }
+
+    void stop() {
+        m_env.taskScheduler().unscheduleDelayedTask(m_task);
+        m_task = nullptr;
+        for (auto & session : m_sessions) {
+            if (session->m_receiver) {
+                m_env.taskScheduler().turnOffBackgroundReadHandling(session->m_fd);
+            }
+            if (session->m_sink) {
+                session->m_sink->stopPlaying();
+                Medium::close(session->m_sink);
+            }
+            m_callback->onCloseSession(session->m_id.c_str());
+        }
+        m_sessions.clear();
+        if (m_session) {
+            if (m_client) {
+                m_client->sendTeardownCommand(*m_session, nullptr);
+            }
+            Medium::close(m_session);
+            m_session = nullptr;
+        }
+        if (m_client) {
+            Medium::close(m_client);
+            m_client = nullptr;
+        }
+    }
+
+    Json::Value toJSON() const {
+        Json::Value json = m_stats.toJSON();
+        json["backend"] = available() ? "recvmmsg" : "recv";
+        json["errors"] = Json::Value::UInt64(m_errors.value());
+        return json;
+    }
+
+private:
+    class Client : public RTSPClient {
+    public:
+        Client(UdpIngest & owner, UsageEnvironment & env, const std::string & url, int verbose)
+            : RTSPClient(env, url.c_str(), verbose, "rtsp2ws", 0, -1), m_owner(owner) {}
+
+        UdpIngest & m_owner;
+    };
+
+    struct Session {
+        UdpIngest*                        m_owner;
+        MediaSubsession*                  m_subsession;
+        std::string                       m_id;
+        int                               m_fd = -1;
+        std::unique_ptr<RtpReceiver>      m_receiver;
+        std::unique_ptr<RtpDepacketizer>  m_depacketizer;
+        MediaSink*                        m_sink = nullptr;
+        // RTP timestamp extended to 64 bits and its time
+        bool                              m_started = false;
+        uint32_t                          m_lastTs = 0;
+        int64_t                           m_extendedTs = 0;
+        int64_t                           m_firstTs = 0;
+        int64_t                           m_firstTime = 0;
+        // offset from the live555 times of a sink, computed again when live555 synchronizes them with RTCP
+        bool                              m_anchored = false;
+        bool                              m_synchronized = false;
+        int64_t                           m_offset = 0;
+    };
+
+    // live555 sink of the media that are not depacketized here
+    class Sink : public MediaSink {
+    public:
+        Sink(UsageEnvironment & env, Session & session) : MediaSink(env), m_session(session), m_buffer(new unsigned char[SINK_BUFFER]) {}
+
+    protected:
+        Boolean continuePlaying() override {
+            if (!fSource) {
+                return False;
+            }
+            fSource->getNextFrame(m_buffer.get(), SINK_BUFFER, afterGettingFrame, this, onSourceClosure, this);
+            return True;
+        }
+
+    private:
+        static void afterGettingFrame(void* clientData, unsigned frameSize, unsigned, struct timeval presentationTime, unsigned) {
+            Sink* sink = static_cast<Sink*>(clientData);
+            sink->m_session.m_owner->m_packets++;
+            struct timeval pts = sink->m_session.m_owner->sinkTime(sink->m_session, presentationTime);
+            sink->m_session.m_owner->m_callback->onData(sink->m_session.m_id.c_str(), sink->m_buffer.get(), frameSize, pts);
+            sink->continuePlaying();
+        }
+
+    private:
+        Session &                         m_session;
+        std::unique_ptr<unsigned char[]>  m_buffer;
+    };
+
+    static void connect(void* clientData) {
+        UdpIngest* ingest = static_cast<UdpIngest*>(clientData);
+        ingest->m_task = nullptr;
+        ingest->m_client = new Client(*ingest, ingest->m_env, ingest->m_url, ingest->m_verbose);
+        ingest->m_client->sendDescribeCommand(onDescribe);
+    }
+
+    void error(const char* step, const char* message) {
+        std::cout << m_url << " " << step << " failed: " << (message ? message : "") << std::endl;
+        m_errors.add();
+        this->start(RECONNECT_DELAY);
+    }
+
+    static void onDescribe(RTSPClient* client, int resultCode, char* resultString) {
+        UdpIngest & ingest = static_cast<Client*>(client)->m_owner;
+        std::unique_ptr<char[]> result(resultString);
+        if (resultCode != 0) {
+            ingest.error("DESCRIBE", resultString);
+            return;
+        }
+        ingest.m_session = MediaSession::createNew(ingest.m_env, resultString);
+        if (!ingest.m_session) {
+            ingest.error("SDP", resultString);
+            return;
+        }
+        ingest.m_setup = std::make_unique<MediaSubsessionIterator>(*ingest.m_session);
+        ingest.setupNext();
+    }
+
+    void setupNext() {
+        MediaSubsession* subsession = nullptr;
+        while ((subsession = m_setup->next()) != nullptr) {
+            if (subsession->initiate()) {
+                m_client->sendSetupCommand(*subsession, onSetup, False, False, m_multicast ? True : False);
+                m_current = subsession;
+                return;
+            }
+        }
+        m_setup.reset();
+        m_client->sendPlayCommand(*m_session, onPlay);
+    }
+
+    static void onSetup(RTSPClient* client, int resultCode, char* resultString) {
+        UdpIngest & ingest = static_cast<Client*>(client)->m_owner;
+        std::unique_ptr<char[]> result(resultString);
+        if (resultCode == 0) {
+            ingest.attach(*ingest.m_current);
+        } else {
+            std::cout << ingest.m_url << " SETUP " << ingest.m_current->mediumName() << "/" << ingest.m_current->codecName() << " failed: " << (resultString ? resultString : "") << std::endl;
+        }
+        ingest.setupNext();
+    }
+
+    void attach(MediaSubsession & subsession) {
+        std::unique_ptr<Session> session = std::make_unique<Session>();
+        session->m_owner = this;
+        session->m_subsession = &subsession;
+        session->m_id = std::string(subsession.mediumName()) + "/" + subsession.codecName();
+        if (!m_callback->onNewSession(session->m_id.c_str(), subsession.mediumName(), subsession.codecName(), subsession.savedSDPLines(), subsession.rtpTimestampFrequency(), subsession.numChannels())) {
+            return;
+        }
+        std::string codec(subsession.codecName());
+        if ((codec == "H264" || codec == "H265") && subsession.rtpSource()) {
+            // the live555 RTP source is never started, its socket is read here
+            session->m_fd = subsession.rtpSource()->RTPgs()->socketNum();
+            increaseReceiveBufferTo(m_env, session->m_fd, RECEIVE_BUFFER);
+            session->m_receiver = std::make_unique<RtpReceiver>(session->m_fd, m_stats);
+            session->m_depacketizer = std::make_unique<RtpDepacketizer>(codec == "H265");
+            m_env.taskScheduler().setBackgroundHandling(session->m_fd, SOCKET_READABLE, onReadable, session.get());
+        } else if (subsession.readSource()) {
+            session->m_sink = new Sink(m_env, *session);
+            session->m_sink->startPlaying(*subsession.readSource(), nullptr, nullptr);
+        }
+        m_sessions.push_back(std::move(session));
+    }
+
+    static void onPlay(RTSPClient* client, int resultCode, char* resultString) {
+        UdpIngest & ingest = static_cast<Client*>(client)->m_owner;
+        std::unique_ptr<char[]> result(resultString);
+        if (resultCode != 0) {
+            ingest.error("PLAY", resultString);
+            return;
+        }
+        ingest.m_lastPackets = ingest.m_packets;
+        ingest.m_task = ingest.m_env.taskScheduler().scheduleDelayedTask(DATA_TIMEOUT * 1000000LL, checkData, &ingest);
+    }
+
+    static void checkData(void* clientData) {
+        UdpIngest* ingest = static_cast<UdpIngest*>(clientData);
+        ingest->m_task = nullptr;
+        if (ingest->m_packets == ingest->m_lastPackets) {
+            ingest->error("data", "timeout");
+            return;
+        }
+        ingest->m_lastPackets = ingest->m_packets;
+        ingest->m_task = ingest->m_env.taskScheduler().scheduleDelayedTask(DATA_TIMEOUT * 1000000LL, checkData, ingest);
+    }
+
+    static void onReadable(void* clientData, int) {
+        Session* session = static_cast<Session*>(clientData);
+        UdpIngest* ingest = session->m_owner;
+        session->m_receiver->read([session, ingest](unsigned char* packet, size_t size, bool lost) {
+            uint16_t seq;
+            uint32_t ts;
+            bool marker;
+            size_t offset, length;
+            if (!parseRtpHeader(packet, size, seq, ts, marker, offset, length)) {
+                return;
+            }
+            ingest->m_packets++;
+            struct timeval presentationTime = ingest->presentationTime(*session, ts);
+            // the start codes are written in front of the payload, over the RTP header
+            session->m_depacketizer->packet(packet + offset, length, lost, [session, ingest, &presentationTime](unsigned char* nal, size_t size) {
+                ingest->m_callback->onData(session->m_id.c_str(), nal, size, presentationTime);
+            });
+        });
+    }
+
+    struct timeval presentationTime(Session & session, uint32_t ts) {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        if (!session.m_started) {
+            session.m_started = true;
+            session.m_lastTs = ts;
+            session.m_extendedTs = ts;
+            session.m_firstTs = ts;
+            session.m_firstTime = now.tv_sec * 1000000LL + now.tv_usec;
+        }
+        session.m_extendedTs += static_cast<int32_t>(ts - session.m_lastTs);
+        session.m_lastTs = ts;
+        unsigned int frequency = session.m_subsession->rtpTimestampFrequency();
+        int64_t time = session.m_firstTime + (frequency ? (session.m_extendedTs - session.m_firstTs) * 1000000 / frequency : 0);
+        struct timeval pts;
+        pts.tv_sec = time / 1000000;
+        pts.tv_usec = time % 1000000;
+        return pts;
+    }
+
+    // live555 times switch to the NTP clock of the server at the first RTCP sender report,
+    // they are anchored on the extrapolated RTP timestamp of the packet at the start and at that switch
+    struct timeval sinkTime(Session & session, struct timeval presentationTime) {
+        int64_t time = presentationTime.tv_sec * 1000000LL + presentationTime.tv_usec;
+        RTPSource* source = session.m_subsession->rtpSource();
+        if (source) {
+            struct timeval extrapolated = this->presentationTime(session, source->curPacketRTPTimestamp());
+            bool synchronized = source->hasBeenSynchronizedUsingRTCP();
+            if (!session.m_anchored || synchronized != session.m_synchronized) {
+                session.m_anchored = true;
+                session.m_synchronized = synchronized;
+                session.m_offset = extrapolated.tv_sec * 1000000LL + extrapolated.tv_usec - time;
+            }
+        }
+        time += session.m_offset;
+        struct timeval pts;
+        pts.tv_sec = time / 1000000;
+        pts.tv_usec = time % 1000000;
+        return pts;
+    }
+
+private:
+    Environment &                              m_env;
+    RTSPConnection::Callback*                  m_callback;
+    const std::string                          m_url;
+    const bool                                 m_multicast;
+    const int                                  m_verbose;
+    Client*                                    m_client;
+    MediaSession*                              m_session;
+    std::unique_ptr<MediaSubsessionIterator>   m_setup;
+    MediaSubsession*                           m_current;
+    std::vector<std::unique_ptr<Session>>      m_sessions;
+    TaskToken                                  m_task;
+    unsigned long long                         m_packets;
+    unsigned long long                         m_lastPackets;
+    RtpReceiver::Stats                         m_stats;
+    Counter                                    m_errors;
+};
@@ -0,0 +1,250 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <json/json.h>
+
+#include "CivetServer.h"
+#include "session.h"
+#include "framebuffer.h"
+#include "framing.h"
+#include "codechandler.h"
+
+/*
+ * Track of an edge stream : the frames of the origin are copied with their timestamp and flags,
+ * the NAL units are not parsed again. The codec and its parameters come from the descriptor of the origin.
+ */
+class RelayHandler : public CodecHandler {
+public:
+    RelayHandler(const SessionParams& params, FramePool& pool, const std::string& codec) : CodecHandler(params, pool, codec, params.m_media != "video") {}
+
+    // SessionParams codec of a websocket codec string, as the RTSP ingest names it
+    static std::string rtspCodec(const std::string & codec) {
+        if (codec.compare(0, 4, "avc1") == 0) {
+            return "H264";
+        } else if (codec.compare(0, 4, "hev1") == 0 || codec.compare(0, 4, "hvc1") == 0) {
+            return "H265";
+        }
+        return codec;
+    }
+
+    void update(const std::string & codec) {
+        this->setCodec(codec);
+    }
+
+    // frame with the binary framing header of the origin
+    std::shared_ptr<Frame> relay(const unsigned char* framed, size_t size) {
+        if (size < WS_FRAMING_HEADER_SIZE) {
+            return nullptr;
+        }
+        uint64_t ts = 0;
+        for (int i = 7; i >= 0; --i) {
+            ts = (ts << 8) | framed[8 + i];
+        }
+        return this->relay(framed + WS_FRAMING_HEADER_SIZE, size - WS_FRAMING_HEADER_SIZE, ts, framed[2]);
+    }
+
+    // frame with its timestamp and flags, as found in the batches of the origin
+    std::shared_ptr<Frame> relay(const unsigned char* data, size_t size, uint64_t ts, int flags) {
+        struct timeval presentationTime;
+        presentationTime.tv_sec = ts / 1000000;
+        presentationTime.tv_usec = ts % 1000000;
+
+        std::shared_ptr<Frame> frame = m_pool.acquire(size);
+        frame->append(data, size);
+        this->stamp(*frame, presentationTime, flags);
+        return frame;
+    }
+};
+
+/*
+ * Websocket client pulling a stream from another rtsp2ws with the binary framing, the origin replays its GOP
+ * cache so the edge starts with a keyframe. The connection runs on its own thread and is reconnected after a delay.
+ * Received messages are given to the callback on the client thread.
+ */
+class WsRelay {
+    static constexpr std::chrono::seconds RECONNECT_DELAY = std::chrono::seconds(5);
+
+public:
+    class Callback {
+    public:
+        virtual ~Callback() = default;
+        virtual void onRelayDescriptor(const std::string & descriptor) = 0;
+        virtual void onRelayFrame(const unsigned char* framed, size_t size) = 0;
+        virtual void onRelayClose() = 0;
+    };
+
+    static bool isRelay(const std::string & url) {
+        return (url.compare(0, 5, "ws://") == 0) || (url.compare(0, 6, "wss://") == 0);
+    }
+
+    WsRelay(const std::string & url, Callback* callback)
+        : m_url(url), m_callback(callback), m_port(80), m_ssl(false), m_path("/"), m_conn(nullptr),
+          m_running(false), m_closed(false), m_stop(false), m_connections(0), m_frames(0), m_bytes(0) {
+        m_ssl = (url.compare(0, 6, "wss://") == 0);
+        std::string hostport = url.substr(m_ssl ? 6 : 5);
+        size_t slash = hostport.find('/');
+        if (slash != std::string::npos) {
+            m_path = hostport.substr(slash);
+            hostport.erase(slash);
+        }
+        size_t colon = hostport.find(':');
+        m_port = m_ssl ? 443 : 80;
+        if (colon != std::string::npos) {
+            m_port = atoi(hostport.c_str() + colon + 1);
+            hostport.erase(colon);
+        }
+        m_host = hostport;
+        m_path += (m_path.find('?') == std::string::npos) ? "?framing=binary" : "&framing=binary";
+        m_thread = std::thread([this]() { this->run(); });
+    }
+
+    WsRelay(const WsRelay&) = delete;
+    WsRelay& operator=(const WsRelay&) = delete;
+
+    ~WsRelay() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+
+    // start and stop do not wait, the client thread may be delivering a message to the callback
+    void start() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = true;
+        }
+        m_cond.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_cond.notify_one();
+    }
+
+    Json::Value toJSON() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Json::Value json;
+        json["origin"] = m_url;
+        json["connected"] = (m_conn != nullptr && !m_closed);
+        json["connections"] = Json::Value::UInt64(m_connections);
+        json["frames"] = Json::Value::UInt64(m_frames);
+        json["bytes"] = Json::Value::UInt64(m_bytes);
+        return json;
+    }
+
+private:
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "relay");
+#endif
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            if (m_conn && (m_closed || !m_running)) {
+                struct mg_connection* conn = m_conn;
+                lock.unlock();
+                mg_close_connection(conn);
+                m_callback->onRelayClose();
+                lock.lock();
+                m_conn = nullptr;
+                if (m_running) {
+                    m_cond.wait_for(lock, RECONNECT_DELAY, [this]() { return m_stop; });
+                }
+            } else if (!m_conn && m_running) {
+                m_closed = false;
+                lock.unlock();
+                char error[256] = {0};
+                struct mg_connection* conn = mg_connect_websocket_client(m_host.c_str(), m_port, m_ssl, error, sizeof(error), m_path.c_str(), nullptr, onData, onClose, this);
+                lock.lock();
+                if (conn) {
+                    m_conn = conn;
+                    m_connections++;
+                } else {
+                    std::cout << "cannot connect " << m_url << ": " << error << std::endl;
+                    m_cond.wait_for(lock, RECONNECT_DELAY, [this]() { return m_stop; });
+                }
+            } else {
+                m_cond.wait(lock);
+            }
+        }
+        if (m_conn) {
+            struct mg_connection* conn = m_conn;
+            m_conn = nullptr;
+            lock.unlock();
+            mg_close_connection(conn);
+        }
+    }
+
+    static int onData(struct mg_connection *conn, int flags, char *data, size_t size, void *userdata) {
+        WsRelay* relay = static_cast<WsRelay*>(userdata);
+        {
+            std::lock_guard<std::mutex> lock(relay->m_mutex);
+            if (!relay->m_running || relay->m_stop) {
+                return 0;
+            }
+            if ((flags & 0xf) == MG_WEBSOCKET_OPCODE_BINARY) {
+                relay->m_frames++;
+                relay->m_bytes += size;
+            }
+        }
+        int opcode = flags & 0xf;
+        if (opcode == MG_WEBSOCKET_OPCODE_TEXT) {
+            relay->m_callback->onRelayDescriptor(std::string(data, size));
+        } else if (opcode == MG_WEBSOCKET_OPCODE_BINARY) {
+            relay->m_callback->onRelayFrame(reinterpret_cast<const unsigned char*>(data), size);
+        }
+        return 1;
+    }
+
+    static void onClose(const struct mg_connection *conn, void *userdata) {
+        WsRelay* relay = static_cast<WsRelay*>(userdata);
+        {
+            std::lock_guard<std::mutex> lock(relay->m_mutex);
+            relay->m_closed = true;
+        }
+        relay->m_cond.notify_one();
+    }
+
+private:
+    const std::string         m_url;
+    Callback*                 m_callback;
+    std::string               m_host;
+    int                       m_port;
+    bool                      m_ssl;
+    std::string               m_path;
+    std::mutex                m_mutex;
+    std::condition_variable   m_cond;
+    struct mg_connection*     m_conn;
+    bool                      m_running;
+    bool                      m_closed;
+    bool                      m_stop;
+    unsigned long long        m_connections;
+    unsigned long long        m_frames;
+    unsigned long long        m_bytes;
+    std::thread               m_thread;
+};
@@ -12,17 +12,40 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <string>
-#include <thread>
+#include <mutex>
+#include <map>
+#include <vector>
 
 #include "WebsocketHandler.h"
 
 #include "rtspconnectionclient.h"
 #include "HttpServerRequestHandler.h"
 #include "session.h"
+#include "framebuffer.h"
+#include "framing.h"
+#include "wssubscriber.h"
+#include "gopcache.h"
+#include "startpolicy.h"
+#include "eventloop.h"
+#include "metrics.h"
 #include "codechandler.h"
-#include "h264handler.h"
-#include "h265handler.h"
+#include "codecregistry.h"
+#include "fmp4muxer.h"
+#include "segmentring.h"
+#include "hlshandler.h"
+#include "substream.h"
+#include "snapshot.h"
+#include "recorder.h"
+#include "dvr.h"
+#include "wsrelay.h"
+#include "audiobatcher.h"
+#include "tracer.h"
+#include "udpingest.h"
+#include "egress.h"
 
 std::map<std::string,std::string> getopts(int timeout, const std::string & rtptransport) {
     std::map<std::string,std::string> opts;
@@ -32,52 +55,328 @@ std::map<std::string,std::string> getopts(int timeout, const std::string & rtptr
 }
 
 template <typename T>
-class WsStream : public WebsocketHandler, public T::Callback
+class WsStream : public WebsocketHandler, public T::Callback, public WsRelay::Callback
 {
+        static constexpr size_t MAX_QUEUE = 64;
+        static constexpr unsigned int DEFAULT_GOP_FRAMES = 300;
+        static constexpr unsigned int DEFAULT_GOP_BYTES = 16*1024*1024;
+        static constexpr double DEFAULT_HLS_SEGMENT = 2.0;
+        static constexpr double DEFAULT_HLS_PART = 0.5;
+        static constexpr double DEFAULT_RECORD_SEGMENT = 60.0;
+
     public:
-        WsStream(HttpServerRequestHandler &httpServer, const std::string & wsurl, const std::string & rtspurl, const std::string & rtptransport, int verbose) :
+        WsStream(HttpServerRequestHandler &httpServer, EventLoopPool & loops, EgressScheduler & egress, const std::string & wsurl, const Json::Value & config, const std::string & rtptransport, int verbose) :
             WebsocketHandler(httpServer.getCallbacks()),
             m_httpServer(httpServer),
+            m_loops(loops),
+            m_loop(loops.acquire()),
+            m_egressScheduler(egress),
             m_wsurl(wsurl),
-            m_env(),
-            m_rtspClient(m_env, this, rtspurl.c_str(), getopts(10, rtptransport), verbose),
-            m_thread(std::thread([this, wsurl]() {
-#ifndef _WIN32
-                pthread_setname_np(m_thread.native_handle(), wsurl.c_str());
-#endif                
-                m_env.mainloop();	
-            })) {
+            m_wsurls(1, wsurl),
+            m_egress(wsurl, config.get("priority", 0).asUInt(), config.get("weight", 1.0).asDouble(), m_metrics.m_sentBytes),
+            m_egressKeyframes(false),
+            m_gopCache(config.get("gop", DEFAULT_GOP_FRAMES).asUInt(), config.get("gopsize", DEFAULT_GOP_BYTES).asUInt()),
+            m_policy(config),
+            m_lingerTask(nullptr),
+            m_audioWindow(config.get("audiowindow", 0).asUInt()*1000ULL),
+            m_batchTask(nullptr),
+            m_running(false),
+            m_fmp4(false),
+            m_lastHttpPull(0),
+            m_traceId(Tracer::instance().stream(wsurl)) {
+                this->configureUrl(wsurl, config);
+                std::string rtspurl = config["video"].asString();
+                bool udp = (rtptransport == "udp" || rtptransport == "multicast");
+                if (WsRelay::isRelay(rtspurl)) {
+                    // edge of another rtsp2ws
+                    m_relay = std::make_unique<WsRelay>(rtspurl, this);
+                } else if (udp && config.get("ingest", "live555").asString() == "recvmmsg") {
+                    m_loop.invoke([this, rtspurl, rtptransport, verbose]() {
+                        m_udpIngest = std::make_unique<UdpIngest>(m_loop.env(), this, rtspurl, rtptransport == "multicast", verbose);
+                    });
+                } else {
+                    m_loop.invoke([this, rtspurl, rtptransport, verbose]() {
+                        m_rtspClient = std::make_unique<T>(m_loop.env(), this, rtspurl.c_str(), getopts(10, rtptransport), verbose);
+                    });
+                }
+                egress.add(&m_egress);
                 httpServer.addWebSocket(wsurl, this);
+                if (m_policy.mode() == StartPolicy::ALWAYS) {
+                    this->startRtsp();
+                }
         }
 
+        // another websocket url served by the same RTSP ingest
+        void addUrl(const std::string & wsurl, const Json::Value & config) {
+            m_wsurls.push_back(wsurl);
+            this->configureUrl(wsurl, config);
+            m_httpServer.addWebSocket(wsurl, this);
+        }
+
+        const std::vector<std::string> & urls() const { return m_wsurls; }
+
         Json::Value toJSON() {
             Json::Value json;
-            for (const auto& [key, value] : m_handler) {
-                json[key] = value->m_params.m_media + "/" + value->m_params.m_codec;
-            }            
+            Json::Value urls(Json::arrayValue);
+            for (const auto & url : m_wsurls) {
+                urls.append(url);
+            }
+            json["urls"] = urls;
+            // the tracks and the ingest are modified by the event loop
+            m_loop.invoke([this, &json]() {
+                for (const auto& track : m_tracks) {
+                    if (track.m_handler) {
+                        json[track.m_id] = track.m_handler->m_params.m_media + "/" + track.m_handler->m_params.m_codec;
+                    }
+                }
+                if (m_udpIngest) {
+                    json["ingest"] = m_udpIngest->toJSON();
+                }
+            });
             json["connections"] = getConnections();
+            json["pool"] = m_pool.toJSON();
+            json["startup"] = m_policy.toJSON();
+            json["loop"] = m_loop.name();
+            json["metrics"] = m_metrics.toJSON();
+            json["egress"] = m_egress.toJSON();
+            Json::Value subscribers(Json::arrayValue);
+            {
+                std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                json["gop"] = m_gopCache.toJSON();
+                for (const auto& it : m_subscribers) {
+                    Json::Value subscriber = it.second->toJSON();
+                    subscriber["substream"] = m_substreams.name(it.second->substream());
+                    auto player = m_players.find(it.first);
+                    if (player != m_players.end()) {
+                        subscriber["dvr"] = player->second->toJSON();
+                    }
+                    subscribers.append(subscriber);
+                }
+                json["substreams"] = m_substreams.toJSON();
+            }
+            json["subscribers"] = subscribers;
+            if (m_segments) {
+                json["hls"] = m_segments->toJSON();
+            }
+            json["snapshot"] = m_snapshots.toJSON();
+            if (m_relay) {
+                json["relay"] = m_relay->toJSON();
+            }
+            if (m_recorder) {
+                json["record"] = m_recorder->toJSON();
+            }
             return json;
         }
 
+        // snapshot requests keep the RTSP connection running like HTTP pulls
+        Snapshot snapshot(int width, std::chrono::milliseconds timeout, SnapshotWorkers & workers) {
+            this->keepAlive();
+            return m_snapshots.get(width, timeout, workers);
+        }
+
+        void writeMetrics(PrometheusWriter & writer) {
+            std::string labels = PrometheusWriter::label("stream", m_wsurl);
+            m_metrics.write(writer, labels);
+            writer.gauge("rtsp2ws_subscribers", "Websocket subscribers", labels, this->getNbConnections());
+        }
+
         virtual ~WsStream() {
-            m_rtspClient.stop();
-            m_env.stop();
-            m_thread.join();
-            m_httpServer.removeWebSocket(m_wsurl);
+            m_egressScheduler.remove(&m_egress);
+            // the players send to their viewer and join live, they are stopped while the subscribers exist
+            std::map<const struct mg_connection*,std::unique_ptr<DvrPlayer>> players;
+            {
+                std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                players.swap(m_players);
+            }
+            players.clear();
+            if (m_segments) {
+                m_segments->close();
+            }
+            for (const auto & handler : m_httpHandlers) {
+                m_httpServer.removeHandler(handler.first);
+            }
+            this->stopRtsp();
+            m_relay.reset();
+            m_loop.invoke([this]() {
+                m_rtspClient.reset();
+                m_udpIngest.reset();
+            });
+            m_loops.release(m_loop);
+            for (const auto & url : m_wsurls) {
+                m_httpServer.removeWebSocket(url);
+            }
         }
 
     private:
         bool handleConnection(CivetServer *server, const struct mg_connection *conn) override {
             if (this->getNbConnections() == 0) {
-                m_rtspClient.start();
+                this->startRtsp();
             }
             return WebsocketHandler::handleConnection(server, conn);
         }
 
+        void  handleReadyState(CivetServer *server, struct mg_connection *conn) override {
+            WebsocketHandler::handleReadyState(server, conn);
+            const struct mg_request_info *req_info = mg_get_request_info(conn);
+            auto it = m_urlConfigs.find(req_info->local_uri);
+            UrlConfig config = (it != m_urlConfigs.end()) ? it->second : UrlConfig();
+            Framing framing = parseFraming(req_info->query_string, config.m_framing);
+            if (framing == Framing::FMP4) {
+                // the loop publishes under the subscriber lock, the packaging is enabled before taking it
+                this->enableFmp4();
+            }
+            std::lock_guard<std::mutex> lock(m_subscriberMutex);
+            int substream = m_substreams.acquire(parseSubstream(req_info->query_string, config.m_substream));
+            std::unique_ptr<WsSubscriber> subscriber = std::make_unique<WsSubscriber>(conn, MAX_QUEUE, framing, m_metrics, substream, m_traceId);
+            char from[32];
+            if (m_recorder && framing != Framing::FMP4 && req_info->query_string && mg_get_var(req_info->query_string, strlen(req_info->query_string), "from", from, sizeof(from)) > 0) {
+                // timeshifted viewer, live frames are sent once the playback caught up
+                char speed[16];
+                double rate = (mg_get_var(req_info->query_string, strlen(req_info->query_string), "speed", speed, sizeof(speed)) > 0) ? atof(speed) : 1.0;
+                subscriber->setLive(false);
+                m_players[conn] = std::make_unique<DvrPlayer>(*m_recorder, m_pool, *subscriber, MAX_QUEUE, parseTimestamp(from), rate, [this, conn]() { this->joinLive(conn); });
+            } else {
+                this->replayGop(*subscriber);
+            }
+            m_subscribers[conn] = std::move(subscriber);
+        }
+
+        // called with m_subscriberMutex held
+        void replayGop(WsSubscriber & subscriber) {
+            const std::vector<WsMessage> & gop = m_gopCache.messages();
+            if ((subscriber.substream() == SubstreamFilters::FULL && !m_egressKeyframes) || gop.empty()) {
+                subscriber.replay(gop, m_gopCache.truncated());
+            } else {
+                // the rest of the GOP is thinned from the next keyframe
+                subscriber.replay(std::vector<WsMessage>(1, gop.front()), true);
+            }
+        }
+
+        void joinLive(const struct mg_connection *conn) {
+            std::lock_guard<std::mutex> lock(m_subscriberMutex);
+            auto it = m_subscribers.find(conn);
+            if (it != m_subscribers.end() && !it->second->live()) {
+                it->second->setLive(true);
+                this->replayGop(*it->second);
+            }
+        }
+
+        // timestamp in microseconds, or seconds before now when negative
+        static uint64_t parseTimestamp(const char* value) {
+            long long ts = strtoll(value, nullptr, 10);
+            if (ts < 0) {
+                long long now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                return std::max(0LL, now + ts * 1000000LL);
+            }
+            return ts;
+        }
+
         void  handleClose(CivetServer *server, const struct mg_connection *conn) override {
+            std::unique_ptr<DvrPlayer> player;
+            {
+                std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                auto it = m_players.find(conn);
+                if (it != m_players.end()) {
+                    player = std::move(it->second);
+                    m_players.erase(it);
+                }
+            }
+            // the player joins live under the subscriber lock, it is stopped before its viewer is removed
+            player.reset();
+            std::unique_ptr<WsSubscriber> subscriber;
+            {
+                std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                auto it = m_subscribers.find(conn);
+                if (it != m_subscribers.end()) {
+                    m_substreams.release(it->second->substream());
+                    subscriber = std::move(it->second);
+                    m_subscribers.erase(it);
+                }
+            }
+            if (subscriber) {
+                m_policy.onViewerFirstFrame(subscriber->firstFrameDelay());
+                subscriber.reset();
+            }
             WebsocketHandler::handleClose(server, conn);
             if (this->getNbConnections() == 0) {
-                m_rtspClient.stop();
+                if (m_policy.mode() == StartPolicy::ONDEMAND && !this->pulledOverHttp()) {
+                    this->stopRtsp();
+                } else if (m_policy.mode() == StartPolicy::ONDEMAND) {
+                    this->lingerRtsp();
+                } else if (m_policy.mode() == StartPolicy::LINGER) {
+                    this->lingerRtsp();
+                }
+            }
+        }
+
+        // RTSP connection is started and stopped on its event loop
+        void startRtsp() {
+            m_loop.invoke([this]() {
+                if (m_lingerTask) {
+                    m_loop.env().taskScheduler().unscheduleDelayedTask(m_lingerTask);
+                    m_lingerTask = nullptr;
+                }
+                if (!m_running) {
+                    m_running = true;
+                    m_policy.onStart();
+                    if (m_relay) {
+                        m_relay->start();
+                    } else if (m_udpIngest) {
+                        m_udpIngest->start();
+                    } else {
+                        m_rtspClient->start();
+                    }
+                }
+            });
+        }
+
+        void stopRtsp() {
+            m_loop.invoke([this]() {
+                if (m_lingerTask) {
+                    m_loop.env().taskScheduler().unscheduleDelayedTask(m_lingerTask);
+                    m_lingerTask = nullptr;
+                }
+                if (m_batchTask) {
+                    m_loop.env().taskScheduler().unscheduleDelayedTask(m_batchTask);
+                    m_batchTask = nullptr;
+                }
+                if (m_running) {
+                    m_running = false;
+                    for (auto & track : m_tracks) {
+                        if (track.m_batcher) {
+                            track.m_batcher->clear();
+                        }
+                    }
+                    if (m_relay) {
+                        m_relay->stop();
+                    } else if (m_udpIngest) {
+                        m_udpIngest->stop();
+                    } else {
+                        m_rtspClient->stop();
+                    }
+                    if (m_segments) {
+                        m_segments->reset();
+                    }
+                    m_snapshots.clear();
+                    std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                    m_gopCache.clear();
+                }
+            });
+        }
+
+        void lingerRtsp() {
+            m_loop.invoke([this]() {
+                if (m_running && !m_lingerTask) {
+                    m_lingerTask = m_loop.env().taskScheduler().scheduleDelayedTask(m_policy.linger()*1000000LL, lingerTimeout, this);
+                }
+            });
+        }
+
+        static void lingerTimeout(void* clientData) {
+            WsStream* stream = static_cast<WsStream*>(clientData);
+            stream->m_lingerTask = nullptr;
+            if (stream->getNbConnections() == 0) {
+                stream->stopRtsp();
             }
         }
 
@@ -85,81 +384,421 @@ class WsStream : public WebsocketHandler, public T::Callback
         bool  onNewSession(const char* id, const char* media, const char* codec, const char* sdp, unsigned int rtpfrequency, unsigned int channels) override { 
             std::cout << id << " " << media << "/" <<  codec << " " << rtpfrequency << "/" << channels << std::endl;
 
-            bool ret = false;
-            if (strcmp(media, "video") == 0) {
-                if (strcmp(codec, "H264") == 0) {
-                    m_handler[id] = std::make_unique<H264Handler>(SessionParams(media, codec, rtpfrequency, channels));
-                    ret = m_handler[id]->onConfig(sdp);
-                } else if (strcmp(codec, "H265") == 0) {
-                    m_handler[id] = std::make_unique<H265Handler>(SessionParams(media, codec, rtpfrequency, channels));
-                    ret =  m_handler[id]->onConfig(sdp);
-                } else if (strcmp(codec, "JPEG") == 0) {
-                    m_handler[id] = std::make_unique<CodecHandler>(SessionParams(media, "jpeg", rtpfrequency, channels));
-                    ret = true;
-                } else {
-                    std::cout << codec << " not supported" << std::endl;
-                }
-            } else if (strcmp(media, "audio") == 0) {
-                if (strcmp(codec, "MPEG4-GENERIC") == 0) {
-                    m_handler[id] = std::make_unique<CodecHandler>(SessionParams(media, "mp4a.40.2", rtpfrequency, channels));
-                    ret = true;
-                } else if (strcmp(codec, "MPA") == 0) {
-                    m_handler[id] = std::make_unique<CodecHandler>(SessionParams(media, "mp3", rtpfrequency, channels));
-                    ret = true;
-                } else if (strcmp(codec, "OPUS") == 0) {
-                    m_handler[id] = std::make_unique<CodecHandler>(SessionParams(media, "opus", rtpfrequency, channels));
-                    ret = true;
-                } else if (strcmp(codec, "PCMU") == 0) {
-                    m_handler[id] = std::make_unique<CodecHandler>(SessionParams(media, "ulaw", rtpfrequency, channels));
-                    ret = true;
-                } else {
-                    std::cout << codec << " not supported" << std::endl;
-                }
-            } else {
-                std::cout << media << " not supported" << std::endl;
+            unsigned char track = m_tracks.size();
+            std::unique_ptr<CodecHandler> handler = CodecRegistry::instance().create(SessionParams(media, codec, rtpfrequency, channels, track), m_pool);
+            if (!handler) {
+                std::cout << media << "/" << codec << " not supported" << std::endl;
+                return false;
             }
+            bool ret = handler->onConfig(sdp);
+            Track entry;
+            entry.m_id = id;
+            entry.m_key = id;
+            entry.m_video = (strcmp(media, "video") == 0);
+            entry.m_handler = std::move(handler);
+            this->createBatcher(entry);
+            if (m_fmp4) {
+                this->createMuxer(entry);
+            }
+            m_tracks.push_back(std::move(entry));
             return ret;
         }
         
         bool    onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime) override {
-            auto it = m_handler.find(id);
-            if (m_handler.find(id) != m_handler.end()) {
-                std::tuple<Json::Value,std::string> data = m_handler[id]->onData(buffer, size, presentationTime);
-                if (!std::get<1>(data).empty()) {
-                    publish(std::get<0>(data), std::get<1>(data)); 
+            auto start = std::chrono::steady_clock::now();
+            Track* track = this->findTrack(id);
+            if (track) {
+                unsigned char trackId = track->m_handler->m_params.m_track;
+                Tracer::trace(Tracer::RECEIVE, m_traceId, trackId, 1000ULL * 1000 * presentationTime.tv_sec + presentationTime.tv_usec);
+                std::shared_ptr<Frame> frame = track->m_handler->onData(buffer, size, presentationTime);
+                if (frame) {
+                    Tracer::trace(Tracer::HANDLED, m_traceId, trackId, frame->timestamp());
+                    publish(*track, frame); 
+                    m_metrics.m_publishLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
                 }
             }
             return true;
         }
         
         void    onError(T& connection, const char* message) override {
+            m_metrics.m_rtspErrors.add();
             connection.start(10);
         }
         
         void    onConnectionTimeout(T& connection) override {
+            m_metrics.m_connectionTimeouts.add();
             connection.start();
         }
         
         void    onDataTimeout(T& connection)  override {
+            m_metrics.m_dataTimeouts.add();
             connection.start();
         }	
 
         void    onCloseSession(const char* id) override {
-            m_handler.erase(id);
+            std::lock_guard<std::mutex> lock(m_subscriberMutex);
+            m_gopCache.clear();
+            Track* track = this->findTrack(id);
+            if (track) {
+                // keep the slot so the other track indexes do not move
+                track->m_handler.reset();
+                track->m_muxer.reset();
+                track->m_batcher.reset();
+                track->m_key = nullptr;
+            }
+            if (m_segments) {
+                m_segments->reset();
+            }
+            m_snapshots.clear();
+            if (std::none_of(m_tracks.begin(), m_tracks.end(), [](const Track & track) { return track.m_handler != nullptr; })) {
+                m_tracks.clear();
+            }
+        }
+
+        // relayed frames are processed on the event loop like the RTSP ones
+        void onRelayDescriptor(const std::string & descriptor) override {
+            m_loop.invoke([this, &descriptor]() {
+                Json::Value json;
+                Json::CharReaderBuilder builder;
+                std::string errors;
+                std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+                if (!reader->parse(descriptor.data(), descriptor.data() + descriptor.size(), &json, &errors)) {
+                    return;
+                }
+                std::string codec = json["codec"].asString();
+                SessionParams params(json["media"].asString(), RelayHandler::rtspCodec(codec), json["freq"].asUInt(), json["channels"].asUInt(), json["track"].asUInt());
+                Track* track = this->findRelayTrack(params.m_track);
+                if (track && track->m_handler->m_params.m_codec == params.m_codec) {
+                    static_cast<RelayHandler*>(track->m_handler.get())->update(codec);
+                    return;
+                }
+                std::cout << m_wsurl << " relay " << params.m_media << "/" << codec << std::endl;
+                if (!track) {
+                    m_tracks.emplace_back();
+                    track = &m_tracks.back();
+                    track->m_id = "relay/" + std::to_string(params.m_track);
+                    track->m_key = nullptr;
+                }
+                track->m_video = (params.m_media == "video");
+                track->m_handler = std::make_unique<RelayHandler>(params, m_pool, codec);
+                track->m_muxer.reset();
+                this->createBatcher(*track);
+                if (m_fmp4) {
+                    this->createMuxer(*track);
+                }
+            });
+        }
+
+        void onRelayFrame(const unsigned char* framed, size_t size) override {
+            if (size < WS_FRAMING_HEADER_SIZE) {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            m_loop.invoke([this, framed, size, start]() {
+                Track* track = this->findRelayTrack(framed[1]);
+                if (track) {
+                    RelayHandler* handler = static_cast<RelayHandler*>(track->m_handler.get());
+                    if (framed[2] & Frame::BATCH) {
+                        // audio window of the origin, the frames are published one by one
+                        readBatch(framed + WS_FRAMING_HEADER_SIZE, size - WS_FRAMING_HEADER_SIZE, [this, track, handler, framed](uint64_t ts, const unsigned char* data, size_t length) {
+                            std::shared_ptr<Frame> frame = handler->relay(data, length, ts, framed[2] & ~Frame::BATCH);
+                            publish(*track, frame);
+                        });
+                        m_metrics.m_publishLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+                    } else {
+                        std::shared_ptr<Frame> frame = handler->relay(framed, size);
+                        if (frame) {
+                            publish(*track, frame);
+                            m_metrics.m_publishLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+                        }
+                    }
+                }
+            });
+        }
+
+        void onRelayClose() override {
+            m_loop.invoke([this]() {
+                std::lock_guard<std::mutex> lock(m_subscriberMutex);
+                m_gopCache.clear();
+                m_tracks.clear();
+                if (m_segments) {
+                    m_segments->reset();
+                }
+                m_snapshots.clear();
+            });
         }
 
     private:
-        void publish(const Json::Value & data, const std::string & buf) const {
-            m_httpServer.publishJSON(m_wsurl, data);
-            m_httpServer.publishBin(m_wsurl, buf.c_str(), buf.size());
+        struct Track {
+            std::string                    m_id;
+            const char*                    m_key;
+            bool                           m_video;
+            std::unique_ptr<CodecHandler>  m_handler;
+            std::unique_ptr<Fmp4Muxer>     m_muxer;
+            std::unique_ptr<AudioBatcher>  m_batcher;
+        };
+
+        // defaults of the viewers connecting to an url
+        struct UrlConfig {
+            Framing        m_framing = Framing::JSON;
+            SubstreamSpec  m_substream;
+        };
+
+        // defaults and HTTP endpoints of an url, fMP4 packaging runs once any url or viewer of the stream needs it
+        void configureUrl(const std::string & wsurl, const Json::Value & config) {
+            Framing framing = parseFraming(config.get("framing", "json").asString());
+            UrlConfig & urlConfig = m_urlConfigs[wsurl];
+            urlConfig.m_framing = framing;
+            urlConfig.m_substream = parseSubstream(config.get("mode", "full").asString(), config.get("maxfps", 0).asUInt());
+            bool hls = config.get("hls", false).asBool();
+            if (hls) {
+                if (!m_segments) {
+                    m_segments = std::make_unique<SegmentRing>(config.get("hlssegment", DEFAULT_HLS_SEGMENT).asDouble(), config.get("hlspart", DEFAULT_HLS_PART).asDouble());
+                }
+                this->addHttpHandler("/hls" + wsurl, std::make_unique<HlsHandler>(*m_segments, [this]() { this->keepAlive(); }));
+                this->addHttpHandler("/fmp4" + wsurl, std::make_unique<Fmp4StreamHandler>(*m_segments, [this]() { this->keepAlive(); }));
+            }
+            std::string record = config.get("record", "").asString();
+            if (!record.empty() && !m_recorder) {
+                m_recorder = std::make_unique<Recorder>(record + wsurl, config.get("recordsegment", DEFAULT_RECORD_SEGMENT).asDouble(),
+                                                        config.get("recordmaxbytes", 0).asUInt64(), config.get("recordmaxage", 0).asUInt());
+            }
+            if (framing == Framing::FMP4 || hls) {
+                this->enableFmp4();
+            }
+        }
+
+        // fMP4 packaging of the video, from the next keyframe
+        void enableFmp4() {
+            m_loop.invoke([this]() {
+                if (!m_fmp4) {
+                    m_fmp4 = true;
+                    for (auto & track : m_tracks) {
+                        this->createMuxer(track);
+                    }
+                }
+            });
+        }
+
+        void addHttpHandler(const std::string & uri, std::unique_ptr<CivetHandler> handler) {
+            m_httpServer.addHandler(uri, handler.get());
+            m_httpHandlers.push_back(std::make_pair(uri, std::move(handler)));
+        }
+
+        static long long nowMs() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        bool pulledOverHttp() const {
+            long long last = m_lastHttpPull;
+            return last && (nowMs() - last < 1000LL * m_policy.linger());
+        }
+
+        // HTTP pulls are not websocket connections, they keep the RTSP connection running like a lingering viewer
+        void keepAlive() {
+            long long now = nowMs();
+            long long last = m_lastHttpPull;
+            if ((now - last < 1000) || !m_lastHttpPull.compare_exchange_strong(last, now)) {
+                return;
+            }
+            m_loop.invoke([this]() {
+                this->startRtsp();
+                if (this->getNbConnections() == 0 && m_policy.mode() != StartPolicy::ALWAYS) {
+                    this->lingerRtsp();
+                }
+            });
+        }
+
+        void createMuxer(Track & track) {
+            if (track.m_handler && track.m_video) {
+                const std::string & codec = track.m_handler->m_params.m_codec;
+                if (codec == "H264" || codec == "H265") {
+                    track.m_muxer = std::make_unique<Fmp4Muxer>(codec == "H265", m_pool);
+                }
+            }
+        }
+
+        // audio frames are sent to the websockets per window when the stream has an audiowindow
+        void createBatcher(Track & track) {
+            if (m_audioWindow && track.m_handler && !track.m_video) {
+                track.m_batcher = std::make_unique<AudioBatcher>(m_pool);
+            } else {
+                track.m_batcher.reset();
+            }
+        }
+
+        // live555 passes the same id buffer for all the packets of a session, compare pointers before strings
+        Track* findTrack(const char* id) {
+            for (auto & track : m_tracks) {
+                if (track.m_key == id) {
+                    return &track;
+                }
+            }
+            for (auto & track : m_tracks) {
+                if (track.m_handler && track.m_id == id) {
+                    track.m_key = id;
+                    return &track;
+                }
+            }
+            return nullptr;
+        }
+
+        Track* findRelayTrack(unsigned char id) {
+            for (auto & track : m_tracks) {
+                if (track.m_handler && track.m_handler->m_params.m_track == id) {
+                    return &track;
+                }
+            }
+            return nullptr;
+        }
+
+        void publish(Track & track, const FramePtr & frame) {
+            const CodecHandler & handler = *track.m_handler;
+            WsMessage msg;
+            msg.m_frame = frame;
+            msg.m_video = track.m_video;
+            msg.m_track = handler.m_params.m_track;
+            msg.m_descriptor = handler.descriptor();
+            if (track.m_muxer) {
+                msg.m_fragment = track.m_muxer->fragment(*frame);
+                msg.m_init = track.m_muxer->init();
+                if (m_segments && msg.m_fragment) {
+                    m_segments->add(msg.m_init, msg.m_fragment);
+                }
+            }
+            msg.m_published = std::chrono::steady_clock::now();
+            if (msg.m_video) {
+                m_snapshots.update(frame, handler.m_params.m_codec);
+            }
+            if (m_recorder) {
+                m_recorder->push(msg);
+            }
+
+            m_policy.onFrame(msg.m_video && frame->isKeyFrame());
+            int media = msg.m_video ? StreamMetrics::VIDEO : StreamMetrics::AUDIO;
+            m_metrics.m_frames[media].add();
+            m_metrics.m_bytes[media].add(frame->size());
+            if (msg.m_video && frame->isKeyFrame()) {
+                m_metrics.m_keyframes.add();
+            }
+
+            Tracer::trace(Tracer::PUBLISHED, m_traceId, msg.m_track, frame->timestamp());
+            if (track.m_batcher) {
+                // sent and cached with the window, or before the video that follows it
+                track.m_batcher->add(frame);
+                if (track.m_batcher->span() >= m_audioWindow) {
+                    this->flushBatch(track);
+                } else if (!m_batchTask) {
+                    m_batchTask = m_loop.env().taskScheduler().scheduleDelayedTask(m_audioWindow, batchTimeout, this);
+                }
+                return;
+            }
+            if (msg.m_video && m_audioWindow) {
+                // keep the websockets in presentation order
+                for (auto & audio : m_tracks) {
+                    if (audio.m_batcher) {
+                        this->flushBatch(audio, frame->timestamp());
+                    }
+                }
+            }
+            this->fanout(msg, &msg, 1);
+        }
+
+        void flushBatch(Track & track, uint64_t until = UINT64_MAX) {
+            std::vector<FramePtr> frames;
+            FramePtr batch = track.m_batcher->take(frames, until);
+            if (batch) {
+                WsMessage msg;
+                msg.m_frame = batch;
+                msg.m_video = false;
+                msg.m_track = track.m_handler->m_params.m_track;
+                msg.m_descriptor = track.m_handler->descriptor();
+                msg.m_published = std::chrono::steady_clock::now();
+                // the GOP cache keeps the frames of the batch
+                std::vector<WsMessage> cached(frames.size(), msg);
+                for (size_t i = 0; i < frames.size(); ++i) {
+                    cached[i].m_frame = frames[i];
+                }
+                this->fanout(msg, cached.data(), cached.size());
+            }
+        }
+
+        static void batchTimeout(void* clientData) {
+            WsStream* stream = static_cast<WsStream*>(clientData);
+            stream->m_batchTask = nullptr;
+            for (auto & track : stream->m_tracks) {
+                if (track.m_batcher) {
+                    stream->flushBatch(track);
+                }
+            }
+        }
+
+        // the GOP cache and the viewers are updated under the same lock, a joining viewer gets a frame from the replay or live, not both
+        void fanout(const WsMessage & msg, const WsMessage* cached, size_t count) {
+            std::lock_guard<std::mutex> lock(m_subscriberMutex);
+            for (size_t i = 0; i < count; ++i) {
+                m_gopCache.add(cached[i]);
+            }
+            uint32_t substreams = msg.m_video ? m_substreams.select(*msg.m_frame) : ~0u;
+            // the egress budget limits the video to the keyframes, the full video resumes at a keyframe
+            bool essential = !msg.m_video || msg.m_frame->isKeyFrame();
+            if (msg.m_video) {
+                m_egressKeyframes = m_egress.keyframes() || (m_egressKeyframes && !essential);
+            }
+            bool drop = m_egressKeyframes && !essential;
+            // the batch layout is part of the binary framing, the other viewers get the frames of the batch
+            bool batch = (msg.m_frame->flags() & Frame::BATCH) != 0;
+            uint64_t viewers = 0;
+            for (auto & it : m_subscribers) {
+                if (it.second->live() && SubstreamFilters::selected(substreams, it.second->substream())) {
+                    viewers++;
+                    if (drop) {
+                        continue;
+                    }
+                    if (batch && it.second->framing() != Framing::BINARY) {
+                        for (size_t i = 0; i < count; ++i) {
+                            it.second->push(cached[i]);
+                        }
+                    } else {
+                        it.second->push(msg);
+                    }
+                }
+            }
+            m_egress.offer(viewers * msg.m_frame->size(), essential);
         }
 
     private:
         HttpServerRequestHandler &                                    m_httpServer;
+        EventLoopPool &                                               m_loops;
+        EventLoop &                                                   m_loop;
+        EgressScheduler &                                             m_egressScheduler;
         const std::string                                             m_wsurl;
-        Environment                                                   m_env;
-        T                                                             m_rtspClient;
-        std::thread                                                   m_thread;
-        std::map<std::string,std::unique_ptr<CodecHandler>>           m_handler;
+        std::vector<std::string>                                      m_wsurls;
+        std::map<std::string,UrlConfig>                               m_urlConfigs;
+        StreamMetrics                                                 m_metrics;
+        EgressShare                                                   m_egress;
+        bool                                                          m_egressKeyframes;   // guarded by m_subscriberMutex
+        FramePool                                                     m_pool;
+        GopCache                                                      m_gopCache;
+        StartPolicy                                                   m_policy;
+        TaskToken                                                     m_lingerTask;
+        const uint64_t                                                m_audioWindow;
+        TaskToken                                                     m_batchTask;
+        bool                                                          m_running;
+        bool                                                          m_fmp4;
+        std::unique_ptr<SegmentRing>                                  m_segments;
+        SnapshotCache                                                 m_snapshots;
+        std::unique_ptr<Recorder>                                     m_recorder;
+        std::vector<std::pair<std::string,std::unique_ptr<CivetHandler>>> m_httpHandlers;
+        std::atomic<long long>                                        m_lastHttpPull;
+        const uint16_t                                                m_traceId;
+        std::unique_ptr<T>                                            m_rtspClient;
+        std::unique_ptr<WsRelay>                                      m_relay;
+        std::unique_ptr<UdpIngest>                                    m_udpIngest;
+        std::vector<Track>                                            m_tracks;
+        std::mutex                                                    m_subscriberMutex;
+        SubstreamFilters                                              m_substreams;
+        std::map<const struct mg_connection*,std::unique_ptr<DvrPlayer>> m_players;
+        std::map<const struct mg_connection*,std::unique_ptr<WsSubscriber>> m_subscribers;
 
 };
\ No newline at end of file
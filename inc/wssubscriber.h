@@ -0,0 +1,319 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <json/json.h>
+
+#include "CivetServer.h"
+#include "framebuffer.h"
+#include "framing.h"
+#include "metrics.h"
+#include "wswriter.h"
+
+/*
+ * A published frame, shared with all subscribers, with the codec descriptor of its track.
+ */
+struct WsMessage {
+    FramePtr                               m_frame;
+    bool                                   m_video;
+    unsigned char                          m_track;
+    std::shared_ptr<const std::string>     m_descriptor;
+    FramePtr                               m_fragment;      // fMP4 packaging of the frame, when enabled
+    std::shared_ptr<const std::string>     m_init;          // fMP4 init segment of the fragment
+    std::chrono::steady_clock::time_point  m_published;
+};
+
+/*
+ * Bounded send queue of one WebSocket connection, drained by its own writer thread,
+ * so a slow viewer never blocks the RTSP reader nor the other viewers.
+ * When the queue is full, disposable frames are dropped first; if there is none left,
+ * pending video is dropped and the viewer resynchronizes on the next keyframe.
+ */
+class WsSubscriber {
+public:
+    WsSubscriber(struct mg_connection *conn, size_t maxQueue, Framing framing, StreamMetrics & metrics, int substream, uint16_t traceId)
+        : m_conn(conn), m_maxQueue(maxQueue), m_framing(framing), m_substream(substream), m_live(true), m_metrics(metrics), m_writer(conn, metrics, traceId), m_burst(0), m_waitKeyFrame(true), m_stop(false), m_drops(0), m_sent(0),
+          m_created(std::chrono::steady_clock::now()), m_firstFrameDelay(-1),
+          m_thread([this]() { this->run(); }) {
+    }
+
+    WsSubscriber(const WsSubscriber&) = delete;
+    WsSubscriber& operator=(const WsSubscriber&) = delete;
+
+    ~WsSubscriber() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+
+    // queue cached messages ahead of live ones, they do not count in the queue bound
+    void replay(const std::vector<WsMessage> & msgs, bool resync) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            size_t before = m_queue.size();
+            for (const auto & msg : msgs) {
+                if (this->accepts(msg)) {
+                    m_queue.push_back(msg);
+                }
+            }
+            if (m_queue.size() == before) {
+                return;
+            }
+            m_burst += m_queue.size() - before;
+            m_waitKeyFrame = resync;
+        }
+        m_cond.notify_one();
+    }
+
+    void push(const WsMessage & msg) {
+        if (!this->accepts(msg)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (msg.m_video) {
+                if (msg.m_frame->isKeyFrame()) {
+                    m_waitKeyFrame = false;
+                } else if (m_waitKeyFrame) {
+                    this->drop(1);
+                    return;
+                }
+            }
+            if (m_queue.size() >= m_maxQueue + m_burst) {
+                this->makeRoom();
+                if (m_waitKeyFrame && msg.m_video && !msg.m_frame->isKeyFrame()) {
+                    this->drop(1);
+                    return;
+                }
+            }
+            m_queue.push_back(msg);
+        }
+        m_cond.notify_one();
+    }
+
+    Framing framing() const { return m_framing; }
+
+    // substream filtering the video of this viewer
+    int substream() const { return m_substream; }
+
+    // a timeshifted viewer receives the live frames once its playback caught up, guarded by the stream
+    bool live() const { return m_live; }
+    void setLive(bool live) { m_live = live; }
+
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_queue.size();
+    }
+
+    // milliseconds between connection and first frame sent, -1 while none was sent
+    long long firstFrameDelay() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_firstFrameDelay;
+    }
+
+    Json::Value toJSON() {
+        Json::Value json;
+        const struct mg_request_info *req_info = mg_get_request_info(m_conn);
+        if (req_info) {
+            json["remote"] = std::string(req_info->remote_addr) + ":" + std::to_string(req_info->remote_port);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        json["queue"] = Json::Value::UInt64(m_queue.size());
+        json["drops"] = Json::Value::UInt64(m_drops);
+        json["sent"] = Json::Value::UInt64(m_sent);
+        json["writes"] = Json::Value::UInt64(m_writer.writes());
+        json["framing"] = framingName(m_framing);
+        json["resync"] = m_waitKeyFrame;
+        json["firstFrameMs"] = Json::Value::Int64(m_firstFrameDelay);
+        long long lag = 0;
+        if (!m_queue.empty()) {
+            lag = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_queue.front().m_published).count();
+        }
+        json["lag"] = Json::Value::Int64(lag);
+        return json;
+    }
+
+private:
+    // only the packaged video is sent with the fMP4 framing
+    bool accepts(const WsMessage & msg) const {
+        return m_framing != Framing::FMP4 || msg.m_fragment;
+    }
+
+    void drop(size_t count) {
+        m_drops += count;
+        m_metrics.m_drops.add(count);
+    }
+
+    // called with m_mutex held and a full queue
+    void makeRoom() {
+        for (auto it = m_queue.begin(); it != m_queue.end(); ++it) {
+            if (it->m_video && it->m_frame->isDisposable()) {
+                m_queue.erase(it);
+                this->drop(1);
+                m_burst = std::min(m_burst, m_queue.size());
+                return;
+            }
+        }
+
+        // no disposable frame left, drop pending video until next keyframe
+        size_t before = m_queue.size();
+        for (auto it = m_queue.begin(); it != m_queue.end(); ) {
+            it = it->m_video ? m_queue.erase(it) : std::next(it);
+        }
+        if (m_queue.size() >= m_maxQueue) {
+            m_queue.pop_front();
+        }
+        this->drop(before - m_queue.size());
+        m_burst = 0;
+        m_waitKeyFrame = true;
+    }
+
+    void run() {
+#ifndef _WIN32
+        pthread_setname_np(pthread_self(), "wssend");
+#endif
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            if (m_queue.empty() && m_writer.pending()) {
+                // nothing more to gather
+                lock.unlock();
+                uint64_t cpu = WsWriter::threadCpuTime();
+                bool ok = m_writer.flush();
+                m_metrics.m_sendCpu.add(WsWriter::threadCpuTime() - cpu);
+                lock.lock();
+                if (!ok) {
+                    this->broken(lock);
+                }
+                continue;
+            }
+            if (m_queue.empty()) {
+                m_cond.wait(lock);
+                continue;
+            }
+            WsMessage msg = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+
+            uint64_t cpu = WsWriter::threadCpuTime();
+            bool ok = true;
+            switch (m_framing) {
+                case Framing::BINARY: ok = this->sendBinary(msg); break;
+                case Framing::FMP4:   ok = this->sendFmp4(msg); break;
+                default:              ok = this->sendJSON(msg); break;
+            }
+            if (ok) {
+                m_writer.sent(msg.m_track, msg.m_frame->timestamp());
+            }
+            m_metrics.m_sendCpu.add(WsWriter::threadCpuTime() - cpu);
+
+            lock.lock();
+            if (ok) {
+                m_metrics.m_sent.add();
+                if (m_sent++ == 0) {
+                    m_firstFrameDelay = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_created).count();
+                }
+                if (m_burst > 0) {
+                    m_burst--;
+                }
+            } else {
+                this->broken(lock);
+            }
+        }
+    }
+
+    // connection is broken, wait for handleClose
+    void broken(std::unique_lock<std::mutex> & lock) {
+        m_queue.clear();
+        m_cond.wait(lock, [this]() { return m_stop; });
+    }
+
+    // a large frame is sent with one write of its two messages, smaller ones are gathered by the writer
+    bool sendJSON(const WsMessage & msg) {
+        if (msg.m_frame->size() >= WsWriter::COALESCE_SIZE) {
+            std::shared_ptr<const std::vector<unsigned char>> wire = msg.m_frame->jsonWire();
+            return m_writer.wire(wire->data(), wire->size());
+        }
+        return m_writer.message(WS_OPCODE_TEXT, msg.m_frame->meta(), msg.m_frame->metaSize())
+            && m_writer.message(WS_OPCODE_BINARY, msg.m_frame->data(), msg.m_frame->size());
+    }
+
+    // frames carry their websocket header in front of the framing header
+    bool sendFrame(const Frame & frame) {
+        if (frame.wireSize()) {
+            return m_writer.wire(frame.wire(), frame.wireSize());
+        }
+        return m_writer.message(WS_OPCODE_BINARY, frame.framed(), frame.framedSize());
+    }
+
+    bool sendBinary(const WsMessage & msg) {
+        if (m_codecSent[msg.m_track] != msg.m_descriptor) {
+            if (!m_writer.message(WS_OPCODE_TEXT, msg.m_descriptor->c_str(), msg.m_descriptor->size())) {
+                return false;
+            }
+            m_codecSent[msg.m_track] = msg.m_descriptor;
+        }
+        return this->sendFrame(*msg.m_frame);
+    }
+
+    // the init segment follows the descriptor
+    bool sendFmp4(const WsMessage & msg) {
+        if (m_codecSent[msg.m_track] != msg.m_descriptor) {
+            if (!m_writer.message(WS_OPCODE_TEXT, msg.m_descriptor->c_str(), msg.m_descriptor->size())) {
+                return false;
+            }
+            m_codecSent[msg.m_track] = msg.m_descriptor;
+            m_initSent.reset();
+        }
+        if (m_initSent != msg.m_init) {
+            if (!m_writer.message(WS_OPCODE_BINARY, msg.m_init->data(), msg.m_init->size())) {
+                return false;
+            }
+            m_initSent = msg.m_init;
+        }
+        return this->sendFrame(*msg.m_fragment);
+    }
+
+private:
+    struct mg_connection *    m_conn;
+    const size_t              m_maxQueue;
+    const Framing             m_framing;
+    const int                 m_substream;
+    bool                      m_live;
+    StreamMetrics &           m_metrics;
+    WsWriter                  m_writer;
+    std::array<std::shared_ptr<const std::string>,256> m_codecSent;
+    std::shared_ptr<const std::string> m_initSent;
+    size_t                    m_burst;
+    std::mutex                m_mutex;
+    std::condition_variable   m_cond;
+    std::deque<WsMessage>     m_queue;
+    bool                      m_waitKeyFrame;
+    bool                      m_stop;
+    unsigned long long        m_drops;
+    unsigned long long        m_sent;
+    const std::chrono::steady_clock::time_point m_created;
+    long long                 m_firstFrameDelay;
+    std::thread               m_thread;
+};
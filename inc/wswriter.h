@@ -0,0 +1,124 @@
+/*
+ * SPDX-License-Identifier: Unlicense
+ *
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+ * software, either in source code form or as a compiled binary, for any purpose,
+ * commercial or non-commercial, and by any means.
+ *
+ * For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <utility>
+#include <vector>
+
+#include "CivetServer.h"
+#include "framing.h"
+#include "metrics.h"
+#include "tracer.h"
+
+/*
+ * Websocket messages of one connection written with mg_write, the websocket header being built by the writer :
+ * a frame with its header in the headroom, or a large frame with the JSON framing, is one write, the messages smaller than COALESCE_SIZE are gathered
+ * while the sender has more of them queued and written together.
+ */
+class WsWriter {
+public:
+    static constexpr size_t COALESCE_SIZE = 16*1024;
+    static constexpr size_t BUFFER_SIZE = 64*1024;
+
+    WsWriter(struct mg_connection *conn, StreamMetrics & metrics, uint16_t traceId) : m_conn(conn), m_metrics(metrics), m_traceId(traceId) {
+        m_buffer.reserve(BUFFER_SIZE);
+    }
+
+    // a websocket message with its header
+    bool wire(const unsigned char* data, size_t size) {
+        if (size < COALESCE_SIZE) {
+            if ((m_buffer.size() + size > BUFFER_SIZE) && !this->flush()) {
+                return false;
+            }
+            m_buffer.insert(m_buffer.end(), data, data + size);
+            return true;
+        }
+        return this->flush() && this->write(data, size);
+    }
+
+    bool message(uint8_t opcode, const void* data, size_t size) {
+        unsigned char header[WS_HEADER_MAX_SIZE];
+        size_t headerSize = writeWebsocketHeader(header, opcode, size);
+        if ((m_buffer.size() + headerSize + std::min(size, COALESCE_SIZE) > BUFFER_SIZE) && !this->flush()) {
+            return false;
+        }
+        m_buffer.insert(m_buffer.end(), header, header + headerSize);
+        const unsigned char* payload = static_cast<const unsigned char*>(data);
+        if (size < COALESCE_SIZE) {
+            m_buffer.insert(m_buffer.end(), payload, payload + size);
+            return true;
+        }
+        return this->flush() && this->write(payload, size);
+    }
+
+    // trace point of a frame, once its bytes reached the socket
+    void sent(uint8_t track, uint64_t pts) {
+        if (m_buffer.empty()) {
+            Tracer::trace(Tracer::SENT, m_traceId, track, pts);
+        } else if (Tracer::enabled()) {
+            m_pending.push_back(std::make_pair(track, pts));
+        }
+    }
+
+    bool pending() const { return !m_buffer.empty(); }
+
+    bool flush() {
+        if (m_buffer.empty()) {
+            return true;
+        }
+        bool ok = this->write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        for (const auto & frame : m_pending) {
+            Tracer::trace(Tracer::SENT, m_traceId, frame.first, frame.second);
+        }
+        m_pending.clear();
+        return ok;
+    }
+
+    uint64_t writes() const { return m_writes.value(); }
+
+    // CPU time of the calling thread in microseconds
+    static uint64_t threadCpuTime() {
+#ifndef _WIN32
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+            return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+        }
+#endif
+        return 0;
+    }
+
+private:
+    bool write(const void* data, size_t size) {
+        mg_lock_connection(m_conn);
+        int ret = mg_write(m_conn, data, size);
+        mg_unlock_connection(m_conn);
+        m_writes.add();
+        m_metrics.m_writes.add();
+        if (ret > 0) {
+            m_metrics.m_sentBytes.add(ret);
+        }
+        return ret > 0 && static_cast<size_t>(ret) == size;
+    }
+
+private:
+    struct mg_connection *                         m_conn;
+    StreamMetrics &                                m_metrics;
+    const uint16_t                                 m_traceId;
+    std::vector<unsigned char>                     m_buffer;
+    std::vector<std::pair<uint8_t,uint64_t>>       m_pending;
+    Counter                                        m_writes;
+};
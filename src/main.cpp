@@ -59,6 +59,9 @@ int main(int argc, char* argv[])
 		("C,config"      , "Config"                                       , cxxopts::value<std::string>() ) 
 
 		("r,rtptransport", "RTP transport(udp,tcp,multicast,http)"        , cxxopts::value<std::string>()->default_value("tcp"))
+		("L,loops"       , "RTSP event loop threads (0:number of cores)"  , cxxopts::value<unsigned int>()->default_value("0"))
+		("E,egress"      , "Egress budget of the websocket viewers in Mbit/s (0:unlimited)", cxxopts::value<double>()->default_value("0"))
+		("T,trace"       , "Latency trace events kept per thread (0:disabled)", cxxopts::value<unsigned int>()->default_value("0"))
 		;
 
 	auto result = options.parse(argc, argv);
@@ -80,6 +83,8 @@ int main(int argc, char* argv[])
 	std::string sslCertificate = result["sslkeycert"].as<std::string>();
 	std::string nbthreads = result["thread"].as<std::string>();
 	std::string rtptransport = result["rtptransport"].as<std::string>();
+	unsigned int nbloops = result["loops"].as<unsigned int>();
+	Tracer::instance().enable(result["trace"].as<unsigned int>());
 
 	if (result.count("config")) {
 		std::string configFile = result["config"].as<std::string>();
@@ -89,6 +94,10 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (result.count("egress")) {
+		config["egress"] = result["egress"].as<double>();
+	}
+
 	int idx = 0;
 	for (auto arg : result.unmatched()) {
 		config["urls"]["stream" + std::to_string(idx++)]["video"]=arg;
@@ -116,7 +125,7 @@ int main(int argc, char* argv[])
 	}		
 
 	// api server
-	HttpServer server(config, opts, rtptransport, verbose);
+	HttpServer server(config, opts, rtptransport, nbloops, verbose);
 	if (server.getContext() == NULL)
 	{
 		std::cout << "Cannot listen on port:" << port << std::endl; 